@@ -0,0 +1,138 @@
+/*
+ * binning.c - binning and downscaling of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Each output pixel is a sum (or average) of box of source pixels. Binning NxN
+ * and scaling to arbitrary size are the same: boundaries of boxes are i*w/ow.
+ * Source rows of each output row are accumulated into uint16_t row (it's the
+ * most part of work: SSE2 or AVX2 kernels chosen at runtime), then columns of
+ * this row are summed into output pixels.
+ */
+
+#include "main.h"
+#include "binning.h"
+#include "bufpool.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BINNING_X86
+#include <immintrin.h>
+#endif
+
+// add N pixels of src to acc
+typedef void (*accfn)(uint16_t *acc, const uint8_t *src, int N);
+
+static void acc_c(uint16_t *acc, const uint8_t *src, int N){
+	int x;
+	for(x = 0; x < N; ++x) acc[x] += src[x];
+}
+
+#ifdef BINNING_X86
+__attribute__((target("sse2")))
+static void acc_sse2(uint16_t *acc, const uint8_t *src, int N){
+	int x;
+	const __m128i z = _mm_setzero_si128();
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i s = _mm_loadu_si128((const __m128i*)(src + x));
+		__m128i a0 = _mm_loadu_si128((const __m128i*)(acc + x));
+		__m128i a1 = _mm_loadu_si128((const __m128i*)(acc + x + 8));
+		_mm_storeu_si128((__m128i*)(acc + x), _mm_add_epi16(a0, _mm_unpacklo_epi8(s, z)));
+		_mm_storeu_si128((__m128i*)(acc + x + 8), _mm_add_epi16(a1, _mm_unpackhi_epi8(s, z)));
+	}
+	acc_c(acc + x, src + x, N - x);
+}
+
+__attribute__((target("avx2")))
+static void acc_avx2(uint16_t *acc, const uint8_t *src, int N){
+	int x;
+	for(x = 0; x <= N - 32; x += 32){
+		__m256i s0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + x)));
+		__m256i s1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(src + x + 16)));
+		__m256i a0 = _mm256_loadu_si256((const __m256i*)(acc + x));
+		__m256i a1 = _mm256_loadu_si256((const __m256i*)(acc + x + 16));
+		_mm256_storeu_si256((__m256i*)(acc + x), _mm256_add_epi16(a0, s0));
+		_mm256_storeu_si256((__m256i*)(acc + x + 16), _mm256_add_epi16(a1, s1));
+	}
+	acc_c(acc + x, src + x, N - x);
+}
+#endif // BINNING_X86
+
+static accfn accrow = acc_c;
+static const char *isa = "C";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_kernels(){
+#ifdef BINNING_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		accrow = acc_avx2;
+		isa = "AVX2";
+	}else if(__builtin_cpu_supports("sse2")){
+		accrow = acc_sse2;
+		isa = "SSE2";
+	}
+#endif
+	DBG("binning kernels: %s", isa);
+}
+
+/**
+ * @return name of instruction set used by binning kernels
+ */
+const char *binning_isa(){
+	pthread_once(&init_once, init_kernels);
+	return isa;
+}
+
+/**
+ * Bin or downscale image
+ * @param src    - source image (or its ROI)
+ * @param stride - length of source row
+ * @param w, h   - size of source (for binning NxN should be multiple of N)
+ * @param ow, oh - size of result (not less than w/BIN_MAX x h/BIN_MAX)
+ * @param sum    - sum pixels of box (saturating) instead of averaging
+ * @return pool buffer (release it by bufpool_put) or NULL
+ */
+uint8_t *binning(const uint8_t *src, int stride, int w, int h, int ow, int oh, int sum){
+	uint8_t *out, *dst;
+	uint16_t *acc;
+	int *xb, i, j, y;
+	if(ow < 1 || oh < 1 || ow > w || oh > h) return NULL;
+	pthread_once(&init_once, init_kernels);
+	out = dst = bufpool_get((size_t)ow * (size_t)oh);
+	// accumulator and box boundaries share one pool buffer: no heap allocations per frame
+	size_t acclen = (size_t)(w + 1) / 2 * 2; // keep xb aligned
+	acc = (uint16_t*)bufpool_get(acclen * sizeof(uint16_t) + (size_t)(ow + 1) * sizeof(int));
+	xb = (int*)(acc + acclen);
+	for(i = 0; i <= ow; ++i) xb[i] = (int)((int64_t)i * w / ow);
+	for(j = 0; j < oh; ++j, dst += ow){
+		int y0 = (int)((int64_t)j * h / oh), y1 = (int)((int64_t)(j + 1) * h / oh);
+		memset(acc, 0, w * sizeof(uint16_t));
+		for(y = y0; y < y1; ++y) accrow(acc, src + (size_t)y * stride, w);
+		for(i = 0; i < ow; ++i){
+			uint32_t s = 0, n = (uint32_t)((xb[i+1] - xb[i]) * (y1 - y0));
+			int x;
+			for(x = xb[i]; x < xb[i+1]; ++x) s += acc[x];
+			if(sum) dst[i] = (s > 255) ? 255 : (uint8_t)s;
+			else dst[i] = (uint8_t)((s + n/2) / n);
+		}
+	}
+	bufpool_put((uint8_t*)acc);
+	return out;
+}
@@ -0,0 +1,36 @@
+/*
+ * binning.h - binning and downscaling of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __BINNING_H__
+#define __BINNING_H__
+
+#include <stdint.h>
+
+// max binning factor (and max ratio of downscaling): 16x16 sums fit into uint16_t
+#ifndef BIN_MAX
+	#define BIN_MAX					(16)
+#endif
+
+const char *binning_isa();
+uint8_t *binning(const uint8_t *src, int stride, int w, int h, int ow, int oh, int sum);
+
+#endif // __BINNING_H__
@@ -0,0 +1,208 @@
+/*
+ * bufpool.c - pool of refcounted byte buffers
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Buffers are taken from free lists of size classes: powers of two starting
+ * from BUFPOOL_MINSIZE and one more class of exactly the frame size (set by
+ * bufpool_setframe when the resolution is known), so that frames and encoded
+ * images of usual size don't waste memory for rounding. Returned buffers go
+ * back into their lists, so after a few frames the heap isn't touched at all;
+ * counters of bufpool_stats allow to check this.
+ * Each buffer has a hidden header with its class and reference counter.
+ */
+
+#include "main.h"
+#include "bufpool.h"
+
+#define FRAMECLASS          (BUFPOOL_CLASSES)
+
+typedef struct bufhdr{
+	struct bufhdr *next;    // next free buffer in list
+	size_t size;            // capacity
+	int cls;                // size class
+	int refcnt;
+} __attribute__((aligned(64))) bufhdr; // keep data aligned for SIMD
+
+#define HDR(buf)            ((bufhdr*)(buf) - 1)
+#define COUNT(x, n)         __atomic_add_fetch(&counters.x, (n), __ATOMIC_RELAXED)
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bufhdr *freelist[BUFPOOL_CLASSES + 1];
+static int nfree[BUFPOOL_CLASSES + 1];
+static size_t framesize = 0;
+static bufpool_stat counters;
+
+static bufhdr *newbuf(size_t size, int cls){
+	bufhdr *h;
+	if(posix_memalign((void**)&h, 64, sizeof(bufhdr) + size)) ERR("malloc");
+	h->size = size;
+	h->cls = cls;
+	COUNT(mallocs, 1);
+	return h;
+}
+
+static void freebuf(bufhdr *h){
+	free(h);
+	COUNT(frees, 1);
+}
+
+/**
+ * Set size of frame class and fill it with n buffers
+ * @param size - frame size in bytes
+ * @param n    - amount of buffers to allocate
+ */
+void bufpool_setframe(size_t size, int n){
+	bufhdr *h, *old;
+	pthread_mutex_lock(&pool_mutex);
+	if(size != framesize){ // buffers of old size are not needed anymore
+		old = freelist[FRAMECLASS];
+		freelist[FRAMECLASS] = NULL;
+		COUNT(cached, -(uint64_t)nfree[FRAMECLASS]);
+		nfree[FRAMECLASS] = 0;
+		framesize = size;
+	}else old = NULL;
+	for(; nfree[FRAMECLASS] < n && nfree[FRAMECLASS] < BUFPOOL_MAXFREE; ++nfree[FRAMECLASS]){
+		h = newbuf(size, FRAMECLASS);
+		h->next = freelist[FRAMECLASS];
+		freelist[FRAMECLASS] = h;
+		COUNT(cached, 1);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	while((h = old)){
+		old = h->next;
+		freebuf(h);
+	}
+	DBG("frame class: %zd bytes", size);
+}
+
+/**
+ * Get buffer from pool
+ * @param size - minimal size of buffer
+ * @return buffer with refcount 1 (return it by bufpool_put)
+ */
+uint8_t *bufpool_get(size_t size){
+	bufhdr *h;
+	int cls;
+	size_t csize;
+	pthread_mutex_lock(&pool_mutex);
+	if(size <= framesize && size > framesize / 2){
+		cls = FRAMECLASS;
+		csize = framesize;
+	}else{
+		for(cls = 0, csize = BUFPOOL_MINSIZE; csize < size && cls < BUFPOOL_CLASSES - 1; ++cls, csize <<= 1);
+		if(csize < size){ // too large for pool
+			cls = -1;
+			csize = size;
+		}
+	}
+	if(cls > -1 && (h = freelist[cls])){
+		freelist[cls] = h->next;
+		--nfree[cls];
+		COUNT(cached, -1);
+	}else h = NULL;
+	pthread_mutex_unlock(&pool_mutex);
+	if(!h) h = newbuf(csize, cls);
+	h->refcnt = 1;
+	h->next = NULL;
+	COUNT(gets, 1);
+	COUNT(inuse, 1);
+	return (uint8_t*)(h + 1);
+}
+
+/**
+ * Enlarge buffer (like realloc)
+ * @param buf  - buffer got by bufpool_get (or NULL); it's released here
+ * @param used - amount of its bytes to copy into new buffer
+ * @param size - minimal size of new buffer
+ * @return new buffer or buf if it's large enough
+ */
+uint8_t *bufpool_grow(uint8_t *buf, size_t used, size_t size){
+	if(buf && HDR(buf)->size >= size) return buf;
+	uint8_t *n = bufpool_get(size);
+	if(buf){
+		memcpy(n, buf, used);
+		bufpool_put(buf);
+	}
+	return n;
+}
+
+/**
+ * Add reference to buffer
+ * @return buf
+ */
+uint8_t *bufpool_ref(uint8_t *buf){
+	if(buf) __atomic_add_fetch(&HDR(buf)->refcnt, 1, __ATOMIC_SEQ_CST);
+	return buf;
+}
+
+/**
+ * Release buffer: it returns to pool when the last reference is put
+ * @param buf - buffer (or NULL)
+ */
+void bufpool_put(uint8_t *buf){
+	bufhdr *h;
+	if(!buf) return;
+	h = HDR(buf);
+	if(__atomic_sub_fetch(&h->refcnt, 1, __ATOMIC_SEQ_CST)) return;
+	COUNT(puts, 1);
+	COUNT(inuse, -1);
+	if(h->cls > -1){
+		pthread_mutex_lock(&pool_mutex);
+		if(nfree[h->cls] < BUFPOOL_MAXFREE && (h->cls != FRAMECLASS || h->size == framesize)){
+			h->next = freelist[h->cls];
+			freelist[h->cls] = h;
+			++nfree[h->cls];
+			COUNT(cached, 1);
+			h = NULL;
+		}
+		pthread_mutex_unlock(&pool_mutex);
+	}
+	if(h) freebuf(h);
+}
+
+/**
+ * @return 1 if buffer has more than one reference
+ */
+int bufpool_shared(const uint8_t *buf){
+	if(!buf) return 0;
+	return __atomic_load_n(&((const bufhdr*)buf - 1)->refcnt, __ATOMIC_SEQ_CST) > 1;
+}
+
+/**
+ * @return capacity of buffer
+ */
+size_t bufpool_size(const uint8_t *buf){
+	if(!buf) return 0;
+	return ((const bufhdr*)buf - 1)->size;
+}
+
+/**
+ * Get pool counters
+ * @param st (o) - counters
+ */
+void bufpool_stats(bufpool_stat *st){
+	st->gets = __atomic_load_n(&counters.gets, __ATOMIC_RELAXED);
+	st->puts = __atomic_load_n(&counters.puts, __ATOMIC_RELAXED);
+	st->mallocs = __atomic_load_n(&counters.mallocs, __ATOMIC_RELAXED);
+	st->frees = __atomic_load_n(&counters.frees, __ATOMIC_RELAXED);
+	st->inuse = __atomic_load_n(&counters.inuse, __ATOMIC_RELAXED);
+	st->cached = __atomic_load_n(&counters.cached, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+/*
+ * bufpool.h - pool of refcounted byte buffers
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// size of the smallest class
+#ifndef BUFPOOL_MINSIZE
+	#define BUFPOOL_MINSIZE			(4096)
+#endif
+// amount of power-of-two classes (the largest is BUFPOOL_MINSIZE << (BUFPOOL_CLASSES-1))
+#ifndef BUFPOOL_CLASSES
+	#define BUFPOOL_CLASSES			(20)
+#endif
+// max amount of free buffers kept in each class
+#ifndef BUFPOOL_MAXFREE
+	#define BUFPOOL_MAXFREE			(16)
+#endif
+
+typedef struct{
+	uint64_t gets;      // buffers given by bufpool_get
+	uint64_t puts;      // buffers returned to pool
+	uint64_t mallocs;   // heap allocations
+	uint64_t frees;     // buffers returned to heap
+	uint64_t inuse;     // amount of buffers in use now
+	uint64_t cached;    // amount of free buffers in pool
+} bufpool_stat;
+
+void bufpool_setframe(size_t size, int n);
+uint8_t *bufpool_get(size_t size);
+uint8_t *bufpool_grow(uint8_t *buf, size_t used, size_t size);
+uint8_t *bufpool_ref(uint8_t *buf);
+void bufpool_put(uint8_t *buf);
+int bufpool_shared(const uint8_t *buf);
+size_t bufpool_size(const uint8_t *buf);
+void bufpool_stats(bufpool_stat *st);
+
+#endif // __BUFPOOL_H__
@@ -0,0 +1,130 @@
+/*
+ * capsource.c - sources of frames: video devices, generator, files
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <time.h>
+
+#include "main.h"
+#include "bufpool.h"
+#include "capsource.h"
+#include "framebuf.h"
+
+static const capsource *sources[] = {&ffmpeg_source, &mmap_source, &synth_source, &replay_source, NULL};
+static const capsource *cursrc = NULL;
+int videodev_prepared = 0;
+
+// open source, clean up after failure
+static int tryopen(const capsource *src, char *arg, int *w, int *h){
+	if(src->open(arg, w, h)) return 1;
+	src->close();
+	return 0;
+}
+
+/**
+ * Open source given by Global_parameters->source ("name[:argument]")
+ * or video device Global_parameters->videodev
+ * @return 0 if failure
+ */
+int capsource_open(){
+	const capsource *src = NULL;
+	char *name = Global_parameters->source, *arg = Global_parameters->videodev;
+	char buf[128];
+	int i, w, h, ok;
+	if(!name){
+		src = Global_parameters->v4l2direct ? &mmap_source : &ffmpeg_source;
+	}else{
+		size_t l = strcspn(name, ":");
+		for(i = 0; sources[i]; ++i)
+			if(strlen(sources[i]->name) == l && strncmp(sources[i]->name, name, l) == 0) break;
+		if(!(src = sources[i])){
+			/// "Неизвестный источник кадров"
+			WARNX("%s: %s", _("Unknown frames source"), name);
+			return 0;
+		}
+		if(name[l]) arg = name + l + 1;
+		else if(!src->device) arg = NULL;
+	}
+	capsource_close(); // close after errors
+	ok = tryopen(src, arg, &w, &h);
+	for(i = 0; !ok && src->device && i < 256; ++i){ // try other devices
+		snprintf(buf, 128, "/dev/video%d", i);
+		if(arg && strcmp(arg, buf) == 0) continue;
+		ok = tryopen(src, buf, &w, &h);
+	}
+	if(!ok) return 0;
+	DBG("Source %s, frame size: %dx%d", src->name, w, h);
+	bufpool_setframe((size_t)w * (size_t)h, FRAMEBUF_SLOTS);
+	cursrc = src;
+	videodev_prepared = 1;
+	return 1;
+}
+
+/**
+ * Get next frame from current source
+ * @param w,h - size of captured image (or NULL)
+ * @return pointer to GRAY8 data (valid until next call) or NULL in case of error
+ * !!! DON'T even try to free returned data !!!
+ */
+uint8_t *capsource_frame(int *w, int *h){
+	int hh = 0, ww = 0;
+	uint8_t *ret;
+	if(!videodev_prepared || !cursrc){
+		/// "Источник кадров не был открыт функцией capsource_open"
+		WARNX(_("Frames source wasn't opened with capsource_open"));
+		return NULL;
+	}
+	if(!(ret = cursrc->next(&ww, &hh))) return NULL;
+	if(w) *w = ww;
+	if(h) *h = hh;
+	return ret;
+}
+
+/**
+ * Close current source
+ */
+void capsource_close(){
+	if(cursrc) cursrc->close();
+	cursrc = NULL;
+	videodev_prepared = 0;
+}
+
+/**
+ * Sleep until time of next frame for sources without own clock
+ * @param fps - frame rate (<= 0 - don't wait)
+ */
+void capsource_pace(double fps){
+	static struct timespec next = {0, 0};
+	struct timespec now;
+	if(fps <= 0.) return;
+	long period = (long)(1e9 / fps);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next.tv_nsec += period;
+	while(next.tv_nsec >= 1000000000L){
+		++next.tv_sec;
+		next.tv_nsec -= 1000000000L;
+	}
+	// we're late for more than a frame: don't try to catch up
+	double late = (now.tv_sec - next.tv_sec) + (now.tv_nsec - next.tv_nsec) / 1e9;
+	if(late > 1. / fps){
+		next = now;
+		return;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+}
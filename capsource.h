@@ -0,0 +1,54 @@
+/*
+ * capsource.h - sources of frames: video devices, generator, files
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __CAPSOURCE_H__
+#define __CAPSOURCE_H__
+
+#include <stdint.h>
+
+// default frame rate of synthetic and replay sources
+#ifndef CAPSOURCE_FPS
+	#define CAPSOURCE_FPS			25.
+#endif
+
+typedef struct{
+	const char *name;
+	// open source with given argument (device, file, parameters); @return 0 if failure
+	int (*open)(char *arg, int *w, int *h);
+	// get next GRAY8 frame (valid until next call) or NULL
+	uint8_t *(*next)(int *w, int *h);
+	// close source (should be harmless for closed source)
+	void (*close)();
+	int device;     // video device: other /dev/video* could be tried
+} capsource;
+
+extern const capsource ffmpeg_source, mmap_source, synth_source, replay_source;
+
+// flag saying that source is ready; sources clear it after fatal errors
+extern int videodev_prepared;
+
+int capsource_open();
+uint8_t *capsource_frame(int *w, int *h);
+void capsource_close();
+void capsource_pace(double fps);
+
+#endif // __CAPSOURCE_H__
@@ -32,24 +32,22 @@
 #include <libavdevice/avdevice.h>
 #include <libswscale/swscale.h>
 
-#include <png.h>
-#include <jpeglib.h>
 #include <tiffio.h>
 
 #include "main.h"
+#include "capsource.h"
 #include "capture.h"
+#include "convert.h"
 
-// global variables for capture_frame
+// global variables for grab_ffmpeg
 int videoStream;
 AVFormatContext *pFormatCtx = NULL;
 uint8_t *buffer = NULL;
-uint32_t *Imstorage = NULL;
 AVFrame *pFrame = NULL;
 AVFrame *pFrameRGB = NULL;
 AVCodecContext *pCodecCtx = NULL;
 struct SwsContext *sws_ctx = NULL;
-// flag saying that device is ready
-int videodev_prepared = 0;
+convformat convfmt = CONV_NONE; // luma layout if frames can be converted without swscale
 
 
 
@@ -159,12 +157,12 @@ int grab_set_chan(char *devname, int ch_num){
 }
 
 /**
- * Prepare video device to capture
+ * Prepare video device to capture through libavformat
  * @param videodev - device file name
- * @param channel  - number of channel
+ * @param w, h     - image size
  * @return 0 if failure
  */
-int prepare_videodev(char *videodev, int channel){
+static int ffmpeg_open(char *videodev, int *w, int *h){
 	int i, numBytes, averr;
 	AVCodec *pCodec = NULL;
 	AVInputFormat* ifmt;
@@ -189,7 +187,7 @@ int prepare_videodev(char *videodev, int channel){
 //  av_dict_set(&optionsDict, "analyzeduration", "0", 0);
 
 	// set channel
-	if(!grab_set_chan(videodev, channel)){
+	if(!grab_set_chan(videodev, Global_parameters->videochannel)){
 		return 0;
 	}
 
@@ -256,49 +254,70 @@ int prepare_videodev(char *videodev, int channel){
 	numBytes = avpicture_get_size(AV_PIX_FMT_GRAY8, pCodecCtx->width,
 			pCodecCtx->height);
 	buffer = (uint8_t *)av_malloc(numBytes*sizeof(uint8_t));
-	Imstorage = (uint32_t *)av_malloc(numBytes*sizeof(uint32_t));
 	DBG("alloc: %dx%d, full size: %d", pCodecCtx->width, pCodecCtx->height, numBytes);
 	assert(buffer != NULL);
 
-	sws_ctx = sws_getContext(
-		pCodecCtx->width,
-		pCodecCtx->height,
-		pCodecCtx->pix_fmt,
-		pCodecCtx->width,
-		pCodecCtx->height,
-		AV_PIX_FMT_GRAY8,
-		SWS_BILINEAR,
-		NULL,
-		NULL,
-		NULL
-	);
-	assert(sws_ctx != NULL);
+	// luma of these formats could be taken directly, swscale isn't needed
+	switch(pCodecCtx->pix_fmt){
+		case AV_PIX_FMT_GRAY8:
+		case AV_PIX_FMT_NV12:
+		case AV_PIX_FMT_NV21:
+		case AV_PIX_FMT_YUV420P:
+		case AV_PIX_FMT_YUVJ420P:
+		case AV_PIX_FMT_YUV422P:
+		case AV_PIX_FMT_YUVJ422P:
+			convfmt = CONV_GREY;
+		break;
+		case AV_PIX_FMT_YUYV422:
+			convfmt = CONV_YUYV;
+		break;
+		case AV_PIX_FMT_UYVY422:
+			convfmt = CONV_UYVY;
+		break;
+		case AV_PIX_FMT_GRAY16LE:
+			convfmt = CONV_Y16;
+		break;
+		case AV_PIX_FMT_GRAY16BE:
+			convfmt = CONV_Y16BE;
+		break;
+		default:
+			convfmt = CONV_NONE;
+	}
+	DBG("conversion: %s", convfmt == CONV_NONE ? "swscale" : convert_isa());
+	if(convfmt == CONV_NONE){
+		sws_ctx = sws_getContext(
+			pCodecCtx->width,
+			pCodecCtx->height,
+			pCodecCtx->pix_fmt,
+			pCodecCtx->width,
+			pCodecCtx->height,
+			AV_PIX_FMT_GRAY8,
+			SWS_BILINEAR,
+			NULL,
+			NULL,
+			NULL
+		);
+		assert(sws_ctx != NULL);
+	}
 
 	// Assign appropriate parts of buffer to image planes in pFrameRGB
 	// Note that pFrameRGB is an AVFrame, but AVFrame is a superset
 	// of AVPicture
 	avpicture_fill((AVPicture *)pFrameRGB, buffer, AV_PIX_FMT_GRAY8,
 		 pCodecCtx->width, pCodecCtx->height);
-	videodev_prepared = 1;
+	*w = pCodecCtx->width;
+	*h = pCodecCtx->height;
 	return 1;
 }
 
 /**
- * Capture frame and return pointer to its data
+ * Read next frame through libavformat and convert it into GRAY8
  * @param w,h - size of captured image (or NULL)
  * @return pointer to pFrameRGB->data or NULL in case of error
- * !!! DON'T even try to free returned data !!!
  */
-uint8_t *capture_frame(int *w, int *h){
-	int i, r, frameFinished, hh = 0, ww = 0;
-	static int ncaptured = 0;
-//	size_t S;
+static uint8_t *grab_ffmpeg(int *w, int *h){
+	int i, r, frameFinished;
 	uint8_t *ret = NULL;
-	if(!videodev_prepared){
-		/// "     prepare_videodev"
-		WARNX("Video device wasn't prepared with prepare_videodev");
-		return NULL;
-	}
 	AVPacket packet;
 
 	// try to read next frame
@@ -328,7 +347,12 @@ uint8_t *capture_frame(int *w, int *h){
 			return NULL;
 		}
 		// Did we get a video frame?
-		if(frameFinished){
+		if(frameFinished && convfmt != CONV_NONE){
+			ret = convert_gray(convfmt, pFrame->data[0], pFrame->linesize[0],
+				pCodecCtx->width, pCodecCtx->height, buffer);
+			if(w) *w = pCodecCtx->width;
+			if(h) *h = pCodecCtx->height;
+		}else if(frameFinished){
 			// Convert the image from its native format to RGB
 			sws_scale(
 				sws_ctx,
@@ -348,18 +372,6 @@ uint8_t *capture_frame(int *w, int *h){
 			ret = (uint8_t*) pFrameRGB->data[0];
 			if(w) *w = pCodecCtx->width;
 			if(h) *h = pCodecCtx->height;
-			ww = pCodecCtx->width;
-			hh = pCodecCtx->height;
-			if(Global_parameters->nsum > 1){
-				int x,y;
-				uint32_t *optr = Imstorage;
-				uint8_t *iptr = ret;
-				for(y = 0; y < hh; ++y){
-					for(x = 0; x < ww; ++x, ++optr, ++iptr){
-						*optr += *iptr;
-					}
-				}
-			}
 		}else{
 			/// "   "
 			WARNX(_("Can't decode video frame!"));
@@ -370,140 +382,37 @@ uint8_t *capture_frame(int *w, int *h){
 	}
 	// Free the packet that was allocated by av_read_frame
 	av_free_packet(&packet);
-	if(Global_parameters->nsum == 1) return ret;
-	if(++ncaptured >= Global_parameters->nsum){
-		ncaptured = 0;
-		int x,y;
-		uint32_t min = *Imstorage, max = min;
-		uint32_t *iptr = Imstorage;
-		for(y = 0; y < hh; ++y){
-			for(x = 0; x < ww; ++x, ++iptr){
-				uint32_t pix = *iptr;
-				if(pix > max) max = pix;
-				else if(pix < min) min = pix;
-			}
-		}
-		uint32_t w = max - min;
-	//	DBG("scales: min = %d, max = %d, w = %d", min, max, w);
-		if(w > 0){
-			iptr = Imstorage;
-			uint8_t *optr = ret;
-			for(y = 0; y < hh; ++y){
-				for(x = 0; x < ww; ++x, ++optr, ++iptr){
-					*optr = (uint8_t)(((*iptr - min) * 255) / w);
-				}
-			}
-			memset(Imstorage, 0, sizeof(uint32_t) * ww * hh);
-		}
-		return ret;
-	}
-	return NULL;
+	return ret;
 }
 
 /**
  * Free unused memory
  */
-void free_videodev(){
-	if(!videodev_prepared) return; // nothing to do
+static void ffmpeg_close(){
 	// Free the RGB image
 	if(buffer) av_free(buffer);
+	buffer = NULL;
 	if(pFrameRGB) av_free(pFrameRGB);
+	pFrameRGB = NULL;
 	// Free the YUV frame
 	if(pFrame) av_free(pFrame);
+	pFrame = NULL;
 	// Close the codec
 	if(pCodecCtx) avcodec_close(pCodecCtx);
+	pCodecCtx = NULL;
 	// free context
 	if(sws_ctx) sws_freeContext(sws_ctx);
+	sws_ctx = NULL;
 	// Close the video file
 	if(pFormatCtx) avformat_close_input(&pFormatCtx);
-	videodev_prepared = 0;
 }
 
-
-/* structure to store PNG image bytes */
-struct mem_encode{
-	char *buffer;
-	size_t size;
+// video device through libavformat
+const capsource ffmpeg_source = {
+	.name   = "v4l",
+	.open   = ffmpeg_open,
+	.next   = grab_ffmpeg,
+	.close  = ffmpeg_close,
+	.device = 1
 };
 
-void my_png_write_data(png_structp png_ptr, png_bytep data, png_size_t length){
-//	FNAME();
-	struct mem_encode* p=(struct mem_encode*)png_get_io_ptr(png_ptr);
-	size_t nsize = p->size + length;
-	p->buffer = realloc(p->buffer, nsize);
-	if(!p->buffer)
-	png_error(png_ptr, "Write Error");
-	memcpy(p->buffer + p->size, data, length);
-	p->size += length;
-}
-
-uint8_t *getpng(size_t *size, int w, int h, uint8_t *data){
-	FNAME();
-	struct mem_encode state;
-	uint8_t *outbuf = NULL;
-	state.buffer = NULL;
-	state.size = 0;
-	*size = 0;
-	png_structp pngptr = NULL;
-	png_infop infoptr = NULL;
-	uint8_t *row;
-	if((pngptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-							NULL, NULL, NULL)) == NULL){
-		goto done;
-	}
-	png_set_write_fn(pngptr, &state, my_png_write_data, NULL);
-	if((infoptr = png_create_info_struct(pngptr)) == NULL){
-		goto done;
-	}
-	png_set_compression_level(pngptr, 1);
-
-	png_set_IHDR(pngptr, infoptr, w, h, 8, PNG_COLOR_TYPE_GRAY,
-				PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-				PNG_FILTER_TYPE_DEFAULT);
-	png_write_info(pngptr, infoptr);
-	png_set_swap(pngptr);
-	w *= 3;
-	for(row = data; h > 0; row += w, h--)
-		png_write_row(pngptr, row);
-	png_write_end(pngptr, infoptr);
-	outbuf = malloc(state.size);
-	*size = state.size;
-	if(outbuf) memcpy(outbuf, state.buffer, state.size);
-	done:
-	if(pngptr) png_destroy_write_struct(&pngptr, &infoptr);
-	free(state.buffer);
-	return outbuf;
-}
-
-uint8_t *getjpg(size_t *size, int w, int h, uint8_t *data){
-	uint8_t *outbuf = NULL;
-	long unsigned int outlen;
-	uint8_t *row;
-	*size = 0;
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_mem_dest(&cinfo, &outbuf, &outlen);
-	cinfo.image_width      = w;
-	cinfo.image_height     = h;
-	cinfo.input_components = 1;
-	cinfo.in_color_space   = JCS_GRAYSCALE;
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality (&cinfo, 60, 1);
-	jpeg_start_compress(&cinfo, 1);
-	JSAMPROW row_pointer;
-	//DBG("make JPEG: %dx%d", w, h);
-	//w *= 3;
-	int H;
-	//for(row = &data[w*(h-1)]; h > 0; row -= w, h--){
-	for(row = data, H=0; H < h; row += w, H++){
-		row_pointer = (JSAMPROW)row;
-		jpeg_write_scanlines(&cinfo, &row_pointer, 1);
-	}
-	jpeg_finish_compress(&cinfo);
-	*size = outlen;
-	return outbuf;
-}
-
-
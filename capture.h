@@ -30,14 +30,8 @@
 	#define MAX_READING_TRIES		10
 #endif
 
-extern int videodev_prepared;
-int prepare_videodev(char *dev, int channel);
 void list_all_inputs(char *dev);
-uint8_t *capture_frame();
+int grab_set_chan(char *devname, int ch_num);
 int capture_frames(int istart, int N);
-void free_videodev();
-
-uint8_t *getpng(size_t *size, int w, int h, uint8_t *data);
-uint8_t *getjpg(size_t *size, int w, int h, uint8_t *data);
 
 #endif // __CAPTURE_H__
@@ -29,9 +29,13 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <endian.h>
 
 #include "usefull_macros.h"
 #include "parceargs.h"
+#include "proto.h"
+#include "rice.h"
+#include "shmclient.h"
 
 #define BUFSIZE  (20480)
 
@@ -45,6 +49,14 @@ typedef struct{
 	char *host;     // host to connect
 	char *port;     // port of socket
 	char *format;   // image format
+	int binary;     // use binary protocol
+	int subscribe;  // get frames pushed by server
+	char *shmpath;  // Unix socket of server's shared memory ring
+	char *mcast;    // multicast group "group:port[:ifaddr]"
+	char *roi;      // region of interest "x,y,w,h"
+	int bin;        // binning
+	int width;      // or width of downscaled image
+	int quality;    // JPEG quality
 }glob_pars;
 
 glob_pars *parce_args(int argc, char **argv);
@@ -60,7 +72,15 @@ glob_pars Gdefault = {
 	.nframes = 3,
 	.host = "localhost",
 	.port = "54321",
-	.format = "jpg"
+	.format = "jpg",
+	.binary = 0,
+	.subscribe = 0,
+	.shmpath = NULL,
+	.mcast = NULL,
+	.roi = NULL,
+	.bin = 0,
+	.width = 0,
+	.quality = 0
 };
 
 /*
@@ -76,7 +96,23 @@ myoption cmdlnopts[] = {
 	{"nframes", 1,	NULL,	'N',	arg_int,	APTR(&G.nframes),	N_("amount of frames to capture")},
 	{"hostname",1,	NULL,	'h',	arg_string,	APTR(&G.host),		N_("hostname of server")},
 	{"port",	1,	NULL,	'p',	arg_string,	APTR(&G.port),		N_("port to connect")},
-	{"format",	1,	NULL,	'f',	arg_string,	APTR(&G.format),	N_("image format (raw/png/jpg)")},
+	{"format",	1,	NULL,	'f',	arg_string,	APTR(&G.format),	N_("image format (raw/rice/png/jpg)")},
+	/// "использовать двоичный протокол"
+	{"binary",	0,	NULL,	'b',	arg_int,	APTR(&G.binary),	N_("use binary protocol")},
+	/// "подписаться на кадры (двоичный протокол)"
+	{"subscribe",0,	NULL,	'S',	arg_int,	APTR(&G.subscribe),	N_("subscribe to frames (binary protocol)")},
+	/// "получать кадры из разделяемой памяти через Unix-сокет сервера"
+	{"shm",		1,	NULL,	'u',	arg_string,	APTR(&G.shmpath),	N_("get raw frames from shared memory through server's Unix socket")},
+	/// "получать необработанные кадры от группы group:port[:адрес интерфейса]"
+	{"mcast",	1,	NULL,	'M',	arg_string,	APTR(&G.mcast),		N_("get raw frames from multicast group:port[:interface address]")},
+	/// "получать только область x,y,w,h"
+	{"roi",		1,	NULL,	'R',	arg_string,	APTR(&G.roi),		N_("get only region x,y,w,h")},
+	/// "биннинг NxN"
+	{"bin",		1,	NULL,	'B',	arg_int,	APTR(&G.bin),		N_("binning NxN")},
+	/// "уменьшить изображение до данной ширины"
+	{"width",	1,	NULL,	'W',	arg_int,	APTR(&G.width),		N_("downscale image to given width")},
+	/// "качество JPEG (1..100)"
+	{"quality",	1,	NULL,	'q',	arg_int,	APTR(&G.quality),	N_("JPEG quality (1..100)")},
 	// ...
 	end_option
 };
@@ -108,6 +144,60 @@ glob_pars *parce_args(int argc, char **argv){
 }
 
 
+/**
+ * Write image data to a file frameXXX.suffix
+ * @return 0 if false
+ */
+static int writeframe(const uint8_t *data, size_t sz, const char *suffix, int iFrame){
+	int F;
+	char Filename[32];
+	snprintf(Filename, 31, "frame%03d.%s", iFrame, suffix);
+	F = open(Filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if(F < 0){
+		WARN("open(%s)", Filename);
+		return 0;
+	}
+	if((size_t)write(F, data, sz) != sz){
+		WARN("write");
+		close(F);
+		return 0;
+	}
+	if(close(F)){
+		WARN("close");
+		return 0;
+	}
+	/// "Кадр сохранен"
+	green("%s\n", _("Frame saved"));
+	return 1;
+}
+
+/**
+ * Save image data to a file (rice images are decoded and saved as raw)
+ * @param data   - image
+ * @param sz     - its size
+ * @param iFrame - frame number (for filename like frameXXX.png
+ * @return 0 if false
+ */
+int SaveData(uint8_t *data, size_t sz, int iFrame){
+	uint8_t *img;
+	int w, h, ret;
+	if(strcasecmp(G.format, "rice")) return writeframe(data, sz, G.format, iFrame);
+	if(!rice_info(data, sz, &w, &h)){
+		WARNX("Not a rice image");
+		return 0;
+	}
+	img = MALLOC(uint8_t, (size_t)w * h);
+	if(!rice_decode(img, data, sz)){
+		WARNX("Broken rice image");
+		FREE(img);
+		return 0;
+	}
+	printf("rice: %dx%d, %zd bytes (%.2f bits per pixel)\n", w, h, sz, 8. * sz / ((double)w * h));
+	ret = writeframe(img, (size_t)w * h, "raw", iFrame);
+	FREE(img);
+	return ret;
+}
+
 /**
  * Test function to save captured frame to a ppm file
  * @param pFrame - pointer to captured frame
@@ -118,15 +208,8 @@ glob_pars *parce_args(int argc, char **argv){
  * format\nsize\ndata
  */
 int SaveFrame(uint8_t *pFrame, size_t sz, int iFrame){
-	int F;
-	char Filename[32], *eptr;
+	char *eptr;
 	long L;
-	snprintf(Filename, 31, "frame%03d.%s", iFrame, G.format);
-	F = open(Filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if(F < 0){
-		WARN("open(%s)", Filename);
-		return 0;
-	}
 	if(strncasecmp(G.format, (char*)pFrame, strlen(G.format))){
 		WARNX("Wrong format in answer!");
 		return 0;
@@ -137,23 +220,15 @@ int SaveFrame(uint8_t *pFrame, size_t sz, int iFrame){
 		return 0;
 	}
 	L = strtol((char*)pFrame, &eptr, 10);
+	if(eptr && *eptr == 'x') // raw image: WxH
+		L *= strtol(eptr + 1, &eptr, 10);
 	if(!eptr || *eptr != '\n'){
 		WARNX("bad file!");
 		return 0;
 	}
 	++eptr;
 	sz = (size_t)L;
-	if((size_t)write(F, eptr, sz) != sz){
-		WARN("write");
-		return 0;
-	}
-	if(close(F)){
-		WARN("close");
-		return 0;
-	}
-	/// "Кадр сохранен"
-	green("%s\n", _("Frame saved"));
-	return 1;
+	return SaveData((uint8_t*)eptr, sz, iFrame);
 }
 
 /**
@@ -255,6 +330,284 @@ uint8_t *capture_frame(size_t *sz){
 	return recvBuff;
 }
 
+// read exactly L bytes; @return 0 if failure
+static int readall(int fd, void *buf, size_t L){
+	uint8_t *p = buf;
+	while(L){
+		ssize_t r = read(fd, p, L);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return 0;
+		p += r;
+		L -= (size_t)r;
+	}
+	return 1;
+}
+
+// send binary command with format from G.format
+static int sendcmd(int cmd){
+	protohdr h;
+	memset(&h, 0, sizeof(h));
+	h.magic = htole32(PROTO_MAGIC);
+	h.version = PROTO_VERSION;
+	h.cmd = (uint8_t)cmd;
+	if(strcasecmp(G.format, "raw") == 0) h.format = htole16(PROTO_FMT_GRAY8);
+	else if(strcasecmp(G.format, "png") == 0) h.format = htole16(PROTO_FMT_PNG);
+	else if(strcasecmp(G.format, "rice") == 0) h.format = htole16(PROTO_FMT_RICE);
+	else h.format = htole16(PROTO_FMT_JPEG);
+	if(write(sockfd, &h, sizeof(h)) != sizeof(h)){
+		perror("send");
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Set region of interest G.roi for all next frames
+ * @return 0 if failure
+ */
+static int sendroi(){
+	unsigned x, y, w, h;
+	char buf[64];
+	if(sscanf(G.roi, "%u,%u,%u,%u", &x, &y, &w, &h) != 4){
+		WARNX("Wrong ROI, should be x,y,w,h");
+		return 0;
+	}
+	if(G.binary || G.subscribe){ // no reply
+		protohdr p;
+		memset(&p, 0, sizeof(p));
+		p.magic = htole32(PROTO_MAGIC);
+		p.version = PROTO_VERSION;
+		p.cmd = PROTO_ROI;
+		p.x = htole16((uint16_t)x);
+		p.y = htole16((uint16_t)y);
+		p.width = htole32(w);
+		p.height = htole32(h);
+		return write(sockfd, &p, sizeof(p)) == sizeof(p);
+	}
+	int L = snprintf(buf, sizeof(buf), "roi=%u,%u,%u,%u", x, y, w, h);
+	if(write(sockfd, buf, L) != L || !waittoread(sockfd) || (L = read(sockfd, buf, sizeof(buf) - 1)) <= 0){
+		WARNX("Server doesn't accept ROI");
+		return 0;
+	}
+	buf[L] = 0;
+	printf("%s", buf);
+	return 1;
+}
+
+/**
+ * Set binning G.bin or downscaling to G.width for all next frames
+ * @return 0 if failure
+ */
+static int sendscale(){
+	char buf[64];
+	if(G.bin < 0 || G.width < 0 || G.bin > UINT16_MAX){
+		WARNX("Wrong binning or width");
+		return 0;
+	}
+	if(G.binary || G.subscribe){ // no reply
+		protohdr p;
+		memset(&p, 0, sizeof(p));
+		p.magic = htole32(PROTO_MAGIC);
+		p.version = PROTO_VERSION;
+		p.cmd = PROTO_SCALE;
+		p.x = htole16((uint16_t)G.bin);
+		p.width = htole32((uint32_t)G.width);
+		return write(sockfd, &p, sizeof(p)) == sizeof(p);
+	}
+	int L = G.width ? snprintf(buf, sizeof(buf), "width=%d", G.width) : snprintf(buf, sizeof(buf), "bin=%d", G.bin);
+	if(write(sockfd, buf, L) != L || !waittoread(sockfd) || (L = read(sockfd, buf, sizeof(buf) - 1)) <= 0){
+		WARNX("Server doesn't accept binning");
+		return 0;
+	}
+	buf[L] = 0;
+	printf("%s", buf);
+	return 1;
+}
+
+/**
+ * Set JPEG quality G.quality for all next frames
+ * @return 0 if failure
+ */
+static int sendquality(){
+	char buf[64];
+	if(G.quality < 1 || G.quality > 100){
+		WARNX("Quality should be 1..100");
+		return 0;
+	}
+	if(G.binary || G.subscribe){ // no reply
+		protohdr p;
+		memset(&p, 0, sizeof(p));
+		p.magic = htole32(PROTO_MAGIC);
+		p.version = PROTO_VERSION;
+		p.cmd = PROTO_QUALITY;
+		p.x = htole16((uint16_t)G.quality);
+		return write(sockfd, &p, sizeof(p)) == sizeof(p);
+	}
+	int L = snprintf(buf, sizeof(buf), "q=%d", G.quality);
+	if(write(sockfd, buf, L) != L || !waittoread(sockfd) || (L = read(sockfd, buf, sizeof(buf) - 1)) <= 0){
+		WARNX("Server doesn't accept quality");
+		return 0;
+	}
+	buf[L] = 0;
+	printf("%s", buf);
+	return 1;
+}
+
+/**
+ * Read reply of binary protocol
+ * @param sz (o) - size of image
+ * @return image data or NULL
+ */
+uint8_t *read_binframe(size_t *sz){
+	protohdr h;
+	if(!readall(sockfd, &h, sizeof(h))){
+		fprintf(stderr, "Socket closed\n");
+		return NULL;
+	}
+	if(le32toh(h.magic) != PROTO_MAGIC || h.version != PROTO_VERSION){
+		WARNX("Bad reply");
+		return NULL;
+	}
+	if(h.cmd != PROTO_FRAME){
+		WARNX("Server returned error");
+		return NULL;
+	}
+	size_t L = le32toh(h.length);
+	uint8_t *buf = MALLOC(uint8_t, L + 1);
+	if(!readall(sockfd, buf, L)){
+		fprintf(stderr, "Socket closed\n");
+		FREE(buf);
+		return NULL;
+	}
+	printf("frame #%llu, %ux%u at (%u, %u), captured %.3f, %zd bytes\n", (unsigned long long)le64toh(h.frameid),
+		le32toh(h.width), le32toh(h.height), le16toh(h.x), le16toh(h.y), le64toh(h.stamp) / 1e6, L);
+	if(sz) *sz = L;
+	return buf;
+}
+
+/**
+ * Read N frames from shared memory ring and save them to disk
+ * @param istart - started image number (for saving)
+ * @param N      - number of frames
+ * @return number of saved frames
+ */
+int shm_frames(int istart, int N){
+	int saved = 0;
+	shmframe f = {.frameid = 0};
+	shmclient *c = shmclient_open(G.shmpath);
+	if(!c){
+		WARNX("Can't connect to %s", G.shmpath);
+		return 0;
+	}
+	while(saved < N && shmclient_wait(c, f.frameid, 2000)){
+		if(!shmclient_latest(c, &f)) continue;
+		printf("frame #%llu, %dx%d, captured %.3f (%.1fms ago)\n", (unsigned long long)f.frameid,
+			f.w, f.h, f.captured, (dtime() - f.captured) * 1e3);
+		// write data directly from shared memory
+		if(!SaveData((uint8_t*)f.data, (size_t)f.w * (size_t)f.h, istart + saved)) break;
+		if(!shmclient_check(c, &f)) WARNX("Frame was overwritten while saving");
+		++saved;
+	}
+	shmclient_close(c);
+	return saved;
+}
+
+// join multicast group, @return socket or -1
+static int mcast_join(const char *spec){
+	char *str = strdup(spec), *port, *ifaddr = NULL;
+	struct sockaddr_in addr;
+	struct ip_mreq mreq;
+	struct timeval tv = {.tv_sec = 2};
+	int sock = -1, one = 1, rcvbuf = 8 << 20;
+	memset(&addr, 0, sizeof(addr));
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if((port = strchr(str, ':'))){
+		*port++ = 0;
+		if((ifaddr = strchr(port, ':'))) *ifaddr++ = 0;
+	}
+	if(!port || !inet_aton(str, &mreq.imr_multiaddr) || (ifaddr && !inet_aton(ifaddr, &mreq.imr_interface))){
+		WARNX("Wrong multicast address, should be group:port[:interface]");
+		goto ret;
+	}
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(port));
+	addr.sin_addr = mreq.imr_multiaddr;
+	if((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0){
+		WARN("socket()");
+		goto ret;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+		setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq))){
+		WARN("Can't join %s", spec);
+		close(sock);
+		sock = -1;
+	}
+ret:
+	FREE(str);
+	return sock;
+}
+
+/**
+ * Receive N frames from multicast group and save them to disk
+ * @param istart - started image number (for saving)
+ * @param N      - number of frames
+ * @return number of saved frames
+ */
+int mcast_frames(int istart, int N){
+	uint8_t dgram[PROTO_DGRAMSIZE], *frame = NULL;
+	size_t got = 0, flen = 0;
+	uint64_t curid = 0;
+	uint32_t nextseq = 0, lost = 0;
+	int saved = 0, incomplete = 0, first = 1, done = 0;
+	int sock = mcast_join(G.mcast);
+	if(sock < 0) return 0;
+	while(saved < N){
+		ssize_t rd = recv(sock, dgram, sizeof(dgram), 0);
+		if(rd < 0){
+			WARN("recv()");
+			break;
+		}
+		protodgram *h = (protodgram*)dgram;
+		if((size_t)rd < sizeof(protodgram) || le32toh(h->magic) != PROTO_DGRAM_MAGIC
+			|| h->version != PROTO_VERSION) continue;
+		uint32_t seq = le32toh(h->seq), len = le32toh(h->length), off = le32toh(h->offset);
+		size_t L = (size_t)rd - sizeof(protodgram);
+		if(!first && seq != nextseq) lost += seq - nextseq;
+		first = 0;
+		nextseq = seq + 1;
+		if(le64toh(h->frameid) != curid){
+			if(frame && !done) ++incomplete;
+			curid = le64toh(h->frameid);
+			if(len != flen){
+				FREE(frame);
+				frame = MALLOC(uint8_t, len);
+				flen = len;
+			}
+			got = 0;
+			done = 0;
+		}
+		if(done || (size_t)off + L > flen) continue;
+		memcpy(frame + off, dgram + sizeof(protodgram), L);
+		got += L;
+		if(got == flen){
+			printf("frame #%llu, %ux%u, captured %.3f (%.1fms ago)\n", (unsigned long long)curid,
+				le32toh(h->width), le32toh(h->height), le64toh(h->stamp) / 1e6,
+				(dtime() - le64toh(h->stamp) / 1e6) * 1e3);
+			if(!SaveData(frame, flen, istart + saved)) break;
+			++saved;
+			done = 1;
+		}
+	}
+	printf("%d frames saved, %d incomplete, %u datagrams lost\n", saved, incomplete, lost);
+	FREE(frame);
+	close(sock);
+	return saved;
+}
+
 /**
  * Read N frames and save them to disk
  * @param istart - started image number (for saving)
@@ -265,8 +618,24 @@ int capture_frames(int istart, int N){
 	int i, saved = 0;
 	size_t S;
 	uint8_t *pic = NULL;
+	if(G.subscribe){ // server pushes frames
+		if(!sendcmd(PROTO_SUBSCRIBE)) return 0;
+		for(i = 0; i < N; i++){
+			if(!(pic = read_binframe(&S))) break;
+			SaveData(pic, S, istart + saved++);
+			FREE(pic);
+		}
+		sendcmd(PROTO_STOP);
+		return saved;
+	}
 	for(i = 0; i < N; i++){
-		if((pic = capture_frame(&S))){
+		if(G.binary){
+			if(!sendcmd(PROTO_GET)) break;
+			if((pic = read_binframe(&S))){
+				SaveData(pic, S, istart + saved++);
+				FREE(pic);
+			}
+		}else if((pic = capture_frame(&S))){
 			SaveFrame(pic, S, istart + saved++);
 			FREE(pic);
 		}
@@ -279,11 +648,24 @@ int main(int argc, char **argv){
 	parce_args(argc, argv);
 	// test format
 	if((strcasecmp(G.format, "png") != 0) && (strcasecmp(G.format, "raw") != 0)
-		&& (strcasecmp(G.format, "jpg") != 0)){
-		WARNX("Wrong format, should be one of raw/png/jpg!");
+		&& (strcasecmp(G.format, "jpg") != 0) && (strcasecmp(G.format, "rice") != 0)){
+		WARNX("Wrong format, should be one of raw/rice/png/jpg!");
 		return -1;
 	}
+	if(G.shmpath){
+		G.format = "raw";
+		shm_frames(G.istart, G.nframes);
+		return 0;
+	}
+	if(G.mcast){
+		G.format = "raw";
+		mcast_frames(G.istart, G.nframes);
+		return 0;
+	}
 	if(open_socket()) ERRX(_("Can't open socket!"));
+	if(G.roi && !sendroi()) return 1;
+	if((G.bin || G.width) && !sendscale()) return 1;
+	if(G.quality && !sendquality()) return 1;
 	printf("Capture %d frames starting from %d\n", G.nframes, G.istart);
 	capture_frames(G.istart, G.nframes);
 	close(sockfd);
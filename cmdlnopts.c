@@ -19,6 +19,7 @@
  * MA 02110-1301, USA.
  */
 #include "cmdlnopts.h"
+#include "capsource.h"
 #include "main.h"
 
 /*
@@ -34,6 +35,15 @@ glob_pars Gdefault = {
 	.nodaemon        = FALSE,
 	.port            = "54321",
 	.nsum            = 1,
+	.rolling         = FALSE,
+	.stackthreads    = 0,
+	.affinity        = NULL,
+	.nworkers        = 0,
+	.shmpath         = NULL,
+	.mcast           = NULL,
+	.v4l2direct      = FALSE,
+	.source          = NULL,
+	.fps             = CAPSOURCE_FPS,
 };
 
 /*
@@ -53,6 +63,24 @@ myoption cmdlnopts[] = {
 	{"foreground",0,NULL, 'f',		arg_none,	APTR(&G.nodaemon),	N_("work in foreground")},
 	///  N 
 	{"sum",		1,	NULL,	's',	arg_int,	APTR(&G.nsum),		N_("sum N images")},
+	/// " :    N    "
+	{"rolling",	0,	NULL,	'r',	arg_none,	APTR(&G.rolling),	N_("rolling sum: give sum of last N images after each frame")},
+	/// "    (0 -   )"
+	{"stack-threads",1,NULL,'j',	arg_int,	APTR(&G.stackthreads),N_("amount of threads for images summation (0 - by number of CPUs)")},
+	/// "      (, \"0,1\")"
+	{"affinity",1,	NULL,	'a',	arg_string,	APTR(&G.affinity),	N_("CPUs for capture and processing threads (e.g. \"0,1\")")},
+	/// "    V4L2 ( libavformat)"
+	{"mmap",	0,	NULL,	'm',	arg_none,	APTR(&G.v4l2direct),N_("capture through V4L2 mmap streaming (without libavformat)")},
+	/// " : v4l[:], mmap[:], synth[:x[:]], replay:"
+	{"source",	1,	NULL,	'i',	arg_string,	APTR(&G.source),	N_("frames source: v4l[:device], mmap[:device], synth[:WxH[:stars]], replay:file")},
+	/// "   synth  replay"
+	{"fps",		1,	NULL,	'F',	arg_double,	APTR(&G.fps),		N_("frame rate of synth and replay sources")},
+	/// "    (0 -   )"
+	{"workers",	1,	NULL,	'w',	arg_int,	APTR(&G.nworkers),	N_("amount of image encoding threads (0 - by number of CPUs)")},
+	/// "Unix-        "
+	{"shm",		1,	NULL,	'u',	arg_string,	APTR(&G.shmpath),	N_("Unix socket for local clients of shared memory frames ring")},
+	/// "    group:port[: ]"
+	{"mcast",	1,	NULL,	'M',	arg_string,	APTR(&G.mcast),		N_("multicast raw frames to group:port[:interface address]")},
 	/// " "
 	{"port",	1,	NULL,	'p',	arg_string,	APTR(&G.port),		N_("port number")},
 	// ...
@@ -36,6 +36,15 @@ typedef struct{
 	int nodaemon;           // not daemonize
 	char *port;             // port number
 	int nsum;               // sum N images
+	int rolling;            // sum last nsum images after each frame
+	int stackthreads;       // amount of threads for images summation (0 - auto)
+	char *affinity;         // CPUs for capture and processing threads ("cpu0,cpu1")
+	int nworkers;           // amount of encoding threads (0 - auto)
+	int v4l2direct;         // capture through V4L2 mmap streaming instead of libavformat
+	char *source;           // source of frames ("name[:argument]")
+	double fps;             // frame rate of synthetic or replayed frames
+	char *shmpath;          // Unix socket of shared memory frames ring
+	char *mcast;            // multicast group of raw frames ("group:port[:ifaddr]")
 }glob_pars;
 
 glob_pars *parce_args(int argc, char **argv);
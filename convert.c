@@ -0,0 +1,168 @@
+/*
+ * convert.c - fast conversion of captured frames into GRAY8
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * We need only luma, and source size is the same as destination, so there's
+ * no need in swscale: planar formats already have luma plane, packed formats
+ * (and 16-bit gray) need just every second byte. The latter is done by SSE2 or
+ * AVX2 kernels chosen at runtime by CPU detection, with plain C as fallback.
+ */
+
+#include "main.h"
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CONVERT_X86
+#include <immintrin.h>
+#endif
+
+// convert N pixels from packed src into dst
+typedef void (*rowfn)(const uint8_t *src, uint8_t *dst, int N);
+
+static void even_c(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	for(x = 0; x < N; ++x) dst[x] = src[2*x];
+}
+
+static void odd_c(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	for(x = 0; x < N; ++x) dst[x] = src[2*x+1];
+}
+
+#ifdef CONVERT_X86
+__attribute__((target("sse2")))
+static void even_sse2(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	const __m128i m = _mm_set1_epi16(0x00ff);
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 2*x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 2*x + 16));
+		_mm_storeu_si128((__m128i*)(dst + x),
+			_mm_packus_epi16(_mm_and_si128(a, m), _mm_and_si128(b, m)));
+	}
+	even_c(src + 2*x, dst + x, N - x);
+}
+
+__attribute__((target("sse2")))
+static void odd_sse2(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i a = _mm_loadu_si128((const __m128i*)(src + 2*x));
+		__m128i b = _mm_loadu_si128((const __m128i*)(src + 2*x + 16));
+		_mm_storeu_si128((__m128i*)(dst + x),
+			_mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+	}
+	odd_c(src + 2*x, dst + x, N - x);
+}
+
+// packus works inside 128-bit lanes, so quadwords should be reordered after it
+__attribute__((target("avx2")))
+static void even_avx2(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	const __m256i m = _mm256_set1_epi16(0x00ff);
+	for(x = 0; x <= N - 32; x += 32){
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + 2*x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 2*x + 32));
+		__m256i r = _mm256_packus_epi16(_mm256_and_si256(a, m), _mm256_and_si256(b, m));
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(r, 0xD8));
+	}
+	even_c(src + 2*x, dst + x, N - x);
+}
+
+__attribute__((target("avx2")))
+static void odd_avx2(const uint8_t *src, uint8_t *dst, int N){
+	int x;
+	for(x = 0; x <= N - 32; x += 32){
+		__m256i a = _mm256_loadu_si256((const __m256i*)(src + 2*x));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(src + 2*x + 32));
+		__m256i r = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+		_mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(r, 0xD8));
+	}
+	odd_c(src + 2*x, dst + x, N - x);
+}
+#endif // CONVERT_X86
+
+static rowfn even = even_c, odd = odd_c;
+static const char *isa = "C";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_kernels(){
+#ifdef CONVERT_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		even = even_avx2;
+		odd = odd_avx2;
+		isa = "AVX2";
+	}else if(__builtin_cpu_supports("sse2")){
+		even = even_sse2;
+		odd = odd_sse2;
+		isa = "SSE2";
+	}
+#endif
+	DBG("conversion kernels: %s", isa);
+}
+
+/**
+ * @return name of instruction set used by conversion kernels
+ */
+const char *convert_isa(){
+	pthread_once(&init_once, init_kernels);
+	return isa;
+}
+
+/**
+ * Get luma of frame as GRAY8 image
+ * @param fmt    - source layout
+ * @param src    - source data (first plane)
+ * @param stride - length of source row in bytes
+ * @param w, h   - image size
+ * @param dst    - buffer for w*h result pixels
+ * @return src if it could be used directly, dst otherwise or NULL for unsupported format
+ */
+uint8_t *convert_gray(convformat fmt, uint8_t *src, int stride, int w, int h, uint8_t *dst){
+	rowfn fn;
+	int y;
+	pthread_once(&init_once, init_kernels);
+	switch(fmt){
+		case CONV_GREY:
+			if(stride == w) return src;
+			for(y = 0; y < h; ++y, src += stride, dst += w)
+				memcpy(dst, src, w);
+			return dst - w*h;
+		case CONV_YUYV:
+		case CONV_Y16BE:
+			fn = even;
+		break;
+		case CONV_UYVY:
+		case CONV_Y16:
+			fn = odd;
+		break;
+		default:
+			return NULL;
+	}
+	if(stride == 2*w){ // no padding: convert all at once
+		fn(src, dst, w*h);
+		return dst;
+	}
+	for(y = 0; y < h; ++y)
+		fn(src + y*stride, dst + y*w, w);
+	return dst;
+}
@@ -0,0 +1,41 @@
+/*
+ * convert.h - fast conversion of captured frames into GRAY8
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __CONVERT_H__
+#define __CONVERT_H__
+
+#include <stdint.h>
+
+// layouts of luma in source frame
+typedef enum{
+	CONV_NONE = 0,  // unsupported: use swscale
+	CONV_GREY,      // 8 bit gray or planar YUV (NV12, YUV420P...): luma plane goes first
+	CONV_YUYV,      // Y U Y V
+	CONV_UYVY,      // U Y V Y
+	CONV_Y16,       // 16 bit little-endian gray
+	CONV_Y16BE      // 16 bit big-endian gray
+} convformat;
+
+const char *convert_isa();
+uint8_t *convert_gray(convformat fmt, uint8_t *src, int stride, int w, int h, uint8_t *dst);
+
+#endif // __CONVERT_H__
@@ -0,0 +1,282 @@
+/*
+ * encpool.c - pool of encoding threads
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Fixed amount of threads (by number of CPUs), each one has its own deque of
+ * tasks. Tasks submitted by other threads are spread over deques round-robin,
+ * tasks submitted by a worker go to its own deque. Worker takes the newest
+ * task of its deque (its data is still in cache), when it's empty worker
+ * steals the oldest task of other deques. So the amount of concurrent encodings
+ * never exceeds the amount of CPUs, and burst of requests just makes deques longer.
+ * Idle workers sleep on condition variable counting pending tasks.
+ */
+
+#include "main.h"
+#include "encpool.h"
+
+typedef struct{
+	encpool_fn fn;
+	void *arg;
+} enctask;
+
+// ring of tasks: owner works with bottom end, thieves take from top one
+typedef struct{
+	pthread_mutex_t mutex;
+	enctask *tasks;
+	unsigned size;          // size of tasks (power of 2)
+	unsigned top, bottom;   // tasks are in [top, bottom)
+} deque;
+
+static pthread_t threads[ENCPOOL_MAXTHREADS];
+static deque deques[ENCPOOL_MAXTHREADS];
+static int nthreads = 0;
+static unsigned nextdeque = 0;      // deque for the next task from outside
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int pending = 0;             // amount of tasks in all deques
+static int pool_quit = 0;
+static __thread int self = -1;      // number of current worker
+
+// subtasks of encpool_forkjoin
+typedef struct{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int left;           // subtasks not done yet
+} forkgroup;
+
+typedef struct{
+	forkgroup *group;
+	encpool_fn fn;
+	void *arg;
+} forktask;
+
+static void push(deque *d, encpool_fn fn, void *arg){
+	pthread_mutex_lock(&d->mutex);
+	if(d->bottom - d->top == d->size){ // full: make it twice larger
+		enctask *t = MALLOC(enctask, 2 * d->size);
+		unsigned i;
+		for(i = d->top; i != d->bottom; ++i)
+			t[i & (2 * d->size - 1)] = d->tasks[i & (d->size - 1)];
+		FREE(d->tasks);
+		d->tasks = t;
+		d->size *= 2;
+	}
+	d->tasks[d->bottom++ & (d->size - 1)] = (enctask){.fn = fn, .arg = arg};
+	pthread_mutex_unlock(&d->mutex);
+}
+
+// take task from bottom (own == 1) or top; @return 0 if deque is empty
+static int take(deque *d, int own, enctask *t){
+	int ret = 0;
+	pthread_mutex_lock(&d->mutex);
+	if(d->top != d->bottom){
+		if(own) *t = d->tasks[--d->bottom & (d->size - 1)];
+		else *t = d->tasks[d->top++ & (d->size - 1)];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&d->mutex);
+	if(ret) __atomic_sub_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	return ret;
+}
+
+// get task from own deque or steal it from others; @return 0 if there's nothing to do
+static int gettask(int n, unsigned *seed, enctask *t){
+	int i, start;
+	if(take(&deques[n], 1, t)) return 1;
+	start = (int)(rand_r(seed) % nthreads);
+	for(i = 0; i < nthreads; ++i){
+		int v = (start + i) % nthreads;
+		if(v != n && take(&deques[v], 0, t)) return 1;
+	}
+	return 0;
+}
+
+static void *worker(void *arg){
+	int n = (int)(intptr_t)arg;
+	unsigned seed = (unsigned)n + 1;
+	enctask t;
+	self = n;
+	while(1){
+		if(gettask(n, &seed, &t)){
+			t.fn(t.arg);
+			continue;
+		}
+		pthread_mutex_lock(&idle_mutex);
+		// pending could be negative for a while: task is taken before submitter counts it
+		while(__atomic_load_n(&pending, __ATOMIC_SEQ_CST) <= 0 && !pool_quit)
+			pthread_cond_wait(&idle_cond, &idle_mutex);
+		int quit = pool_quit && __atomic_load_n(&pending, __ATOMIC_SEQ_CST) <= 0; // finish all tasks before quit
+		pthread_mutex_unlock(&idle_mutex);
+		if(quit) break;
+	}
+	return NULL;
+}
+
+/**
+ * Run encoding threads
+ * @param n - amount of threads (0 - by number of CPUs)
+ * @return amount of threads run
+ */
+int encpool_start(int n){
+	int i;
+	if(n < 1) n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1) n = 1;
+	if(n > ENCPOOL_MAXTHREADS) n = ENCPOOL_MAXTHREADS;
+	pool_quit = 0;
+	for(i = 0; i < n; ++i){
+		deque *d = &deques[i];
+		pthread_mutex_init(&d->mutex, NULL);
+		d->size = ENCPOOL_DEQUELEN;
+		d->tasks = MALLOC(enctask, d->size);
+		d->top = d->bottom = 0;
+	}
+	nthreads = n; // workers could steal from each other at once
+	for(i = 0; i < n; ++i){
+		if(pthread_create(&threads[i], NULL, worker, (void*)(intptr_t)i)){
+			WARN("pthread_create()");
+			threads[i] = 0;
+			break;
+		}
+	}
+	if(i < n){ // stop started threads and don't use the others' deques
+		encpool_stop();
+		return 0;
+	}
+	DBG("%d encoding threads", n);
+	return n;
+}
+
+/**
+ * Stop threads after all submitted tasks are done
+ */
+void encpool_stop(){
+	int i, n = nthreads;
+	pthread_mutex_lock(&idle_mutex);
+	pool_quit = 1;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+	for(i = 0; i < n; ++i){
+		if(threads[i]) pthread_join(threads[i], NULL);
+		threads[i] = 0;
+	}
+	nthreads = 0;
+	for(i = 0; i < n; ++i){
+		FREE(deques[i].tasks);
+		pthread_mutex_destroy(&deques[i].mutex);
+	}
+}
+
+/**
+ * Put task into the pool
+ * @param fn  - task
+ * @param arg - its argument
+ */
+void encpool_submit(encpool_fn fn, void *arg){
+	int n = self;
+	if(n < 0) n = (int)(__atomic_fetch_add(&nextdeque, 1, __ATOMIC_RELAXED) % (unsigned)nthreads);
+	push(&deques[n], fn, arg);
+	pthread_mutex_lock(&idle_mutex);
+	__atomic_add_fetch(&pending, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+/**
+ * Run one of queued tasks in current thread (task waiting for its subtasks
+ * should help instead of blocking a worker)
+ * @return 1 if task was done, 0 if there's nothing to do
+ */
+int encpool_help(){
+	static __thread unsigned seed = 0;
+	enctask t;
+	int i, start;
+	if(nthreads < 1) return 0;
+	if(self >= 0){
+		if(!gettask(self, &seed, &t)) return 0;
+	}else{ // not a worker: steal only
+		start = (int)(rand_r(&seed) % nthreads);
+		for(i = 0; i < nthreads; ++i)
+			if(take(&deques[(start + i) % nthreads], 0, &t)) break;
+		if(i == nthreads) return 0;
+	}
+	t.fn(t.arg);
+	return 1;
+}
+
+// run subtask of encpool_forkjoin
+static void forkrun(void *arg){
+	forktask *t = arg;
+	t->fn(t->arg);
+	pthread_mutex_lock(&t->group->mutex);
+	if(--t->group->left == 0) pthread_cond_signal(&t->group->cond);
+	pthread_mutex_unlock(&t->group->mutex);
+}
+
+/**
+ * Run n subtasks in parallel and wait until all of them are done: the first one
+ * runs in current thread, others are given to pool; while waiting current
+ * thread runs queued tasks (so a worker could call this without deadlock);
+ * subtasks over ENCPOOL_MAXTHREADS run in current thread too
+ * @param fn      - subtask
+ * @param args    - array of n arguments
+ * @param argsize - size of each argument
+ * @param n       - amount of subtasks
+ */
+void encpool_forkjoin(encpool_fn fn, void *args, size_t argsize, int n){
+	forkgroup group;
+	forktask tasks[ENCPOOL_MAXTHREADS]; // no heap allocations per frame
+	int i, left, m = (n > ENCPOOL_MAXTHREADS) ? ENCPOOL_MAXTHREADS : n;
+	if(n < 1) return;
+	if(nthreads < 1){ // no pool: do it sequentially
+		for(i = 0; i < n; ++i) fn((uint8_t*)args + argsize * i);
+		return;
+	}
+	pthread_mutex_init(&group.mutex, NULL);
+	pthread_cond_init(&group.cond, NULL);
+	group.left = m - 1;
+	for(i = 1; i < m; ++i){
+		tasks[i] = (forktask){.group = &group, .fn = fn, .arg = (uint8_t*)args + argsize * i};
+		encpool_submit(forkrun, &tasks[i]);
+	}
+	fn(args);
+	for(i = m; i < n; ++i) fn((uint8_t*)args + argsize * i);
+	while(1){
+		pthread_mutex_lock(&group.mutex);
+		left = group.left;
+		pthread_mutex_unlock(&group.mutex);
+		if(!left) break;
+		if(!encpool_help()){ // all subtasks are taken by other threads
+			pthread_mutex_lock(&group.mutex);
+			while(group.left) pthread_cond_wait(&group.cond, &group.mutex);
+			pthread_mutex_unlock(&group.mutex);
+			break;
+		}
+	}
+	pthread_mutex_destroy(&group.mutex);
+	pthread_cond_destroy(&group.cond);
+}
+
+/**
+ * @return amount of running threads (0 - pool isn't started)
+ */
+int encpool_threads(){
+	return nthreads;
+}
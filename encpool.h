@@ -0,0 +1,47 @@
+/*
+ * encpool.h - pool of encoding threads
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __ENCPOOL_H__
+#define __ENCPOOL_H__
+
+#include <stddef.h>
+
+// max amount of encoding threads
+#ifndef ENCPOOL_MAXTHREADS
+	#define ENCPOOL_MAXTHREADS		(16)
+#endif
+
+// initial size of each thread's deque (it grows when needed)
+#ifndef ENCPOOL_DEQUELEN
+	#define ENCPOOL_DEQUELEN		(64)
+#endif
+
+typedef void (*encpool_fn)(void *arg);
+
+int encpool_start(int nthreads);
+void encpool_stop();
+void encpool_submit(encpool_fn fn, void *arg);
+int encpool_help();
+void encpool_forkjoin(encpool_fn fn, void *args, size_t argsize, int n);
+int encpool_threads();
+
+#endif // __ENCPOOL_H__
@@ -0,0 +1,222 @@
+/*
+ * framebuf.c - lock-free publication of captured frames
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Frames live in a fixed set of slots. Each slot has a reference counter shared
+ * by the writer (who claims a free slot, fills it and publishes it) and by
+ * readers (who hold the latest published slot while encoding it).
+ * The writer never waits: it takes any slot that is neither the latest one nor
+ * used by somebody; if there's no such slot the frame is simply dropped.
+ * Readers take a reference to the latest slot and then check that it is still
+ * the latest one: if it is, it can't be reused until they put it back.
+ * Readers waiting for a new frame sleep on a futex incremented by each
+ * publication; the writer makes the wake syscall only if somebody sleeps.
+ * Event loops get notifications through subscribed eventfd's.
+ * Slot data could be referenced by raw images being sent: such buffer isn't
+ * overwritten, the slot gets another one from pool instead.
+ */
+
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <time.h>
+
+#include "main.h"
+#include "bufpool.h"
+#include "framebuf.h"
+
+#define ATOMIC_LOAD(x)      __atomic_load_n(&(x), __ATOMIC_SEQ_CST)
+#define ATOMIC_INC(x)       __atomic_add_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+#define ATOMIC_DEC(x)       __atomic_sub_fetch(&(x), 1, __ATOMIC_SEQ_CST)
+
+static imframe slots[FRAMEBUF_SLOTS];
+static imframe *latest = NULL; // last published frame
+static uint64_t lastid = 0;    // its number
+static uint32_t pubseq = 0;    // futex word: changes on each publication
+static int nwaiters = 0;       // amount of readers sleeping on pubseq
+static int subscribers[FRAMEBUF_MAXSUBS]; // eventfd's to signal plus 1 (0 - empty)
+
+/**
+ * Get free slot for a new frame
+ * @param w, h - image size
+ * @return slot with data of at least w*h bytes or NULL if all slots are busy
+ */
+imframe *framebuf_claim(int w, int h){
+	int i;
+	size_t S = (size_t)w * (size_t)h;
+	for(i = 0; i < FRAMEBUF_SLOTS; ++i){
+		imframe *f = &slots[i];
+		int z = 0;
+		if(f == ATOMIC_LOAD(latest)) continue;
+		if(!__atomic_compare_exchange_n(&f->refcnt, &z, 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			continue;
+		if(f == ATOMIC_LOAD(latest)){ // was published while we tried to take it
+			ATOMIC_DEC(f->refcnt);
+			continue;
+		}
+		if(bufpool_shared(f->data)){ // still sent to somebody: leave it to them
+			bufpool_put(f->data);
+			f->data = NULL;
+			f->size = 0;
+		}
+		if(f->size < S){
+			bufpool_put(f->data);
+			f->data = bufpool_get(S);
+			f->size = bufpool_size(f->data);
+		}
+		f->w = w;
+		f->h = h;
+		return f;
+	}
+	DBG("All frame slots are busy, drop frame");
+	return NULL;
+}
+
+/**
+ * Make filled slot the latest frame
+ * @param f - slot got by framebuf_claim
+ */
+void framebuf_publish(imframe *f){
+	int i;
+	if(!f) return;
+	f->id = lastid + 1;
+	f->stamp = dtime();
+	__atomic_store_n(&latest, f, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&lastid, f->id, __ATOMIC_SEQ_CST);
+	ATOMIC_DEC(f->refcnt);
+	ATOMIC_INC(pubseq);
+	if(ATOMIC_LOAD(nwaiters))
+		syscall(SYS_futex, &pubseq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	for(i = 0; i < FRAMEBUF_MAXSUBS; ++i){
+		int fd = ATOMIC_LOAD(subscribers[i]);
+		if(fd) eventfd_write(fd - 1, 1);
+	}
+}
+
+/**
+ * Return claimed slot without publication
+ * @param f - slot got by framebuf_claim
+ */
+void framebuf_drop(imframe *f){
+	if(f) ATOMIC_DEC(f->refcnt);
+}
+
+/**
+ * Get the latest frame; it won't be changed until framebuf_put
+ * @return latest frame or NULL if there's no frames yet
+ */
+imframe *framebuf_get(){
+	imframe *f;
+	while((f = ATOMIC_LOAD(latest))){
+		ATOMIC_INC(f->refcnt);
+		if(f == ATOMIC_LOAD(latest)) return f;
+		ATOMIC_DEC(f->refcnt); // writer published another frame, try again
+	}
+	return NULL;
+}
+
+/**
+ * Take one more reference to frame got by framebuf_get
+ * @param f - frame
+ * @return f
+ */
+imframe *framebuf_ref(imframe *f){
+	if(f) ATOMIC_INC(f->refcnt);
+	return f;
+}
+
+/**
+ * Release frame got by framebuf_get
+ * @param f - frame
+ */
+void framebuf_put(imframe *f){
+	if(f) ATOMIC_DEC(f->refcnt);
+}
+
+/**
+ * @return number of the latest published frame (0 if none)
+ */
+uint64_t framebuf_lastid(){
+	return ATOMIC_LOAD(lastid);
+}
+
+/**
+ * Signal eventfd on each publication
+ * @param efd - eventfd
+ * @return 0 if there's too much subscribers
+ */
+int framebuf_subscribe(int efd){
+	int i;
+	for(i = 0; i < FRAMEBUF_MAXSUBS; ++i){
+		int z = 0;
+		if(__atomic_compare_exchange_n(&subscribers[i], &z, efd + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Stop signalling eventfd
+ * @param efd - eventfd given to framebuf_subscribe
+ */
+void framebuf_unsubscribe(int efd){
+	int i;
+	for(i = 0; i < FRAMEBUF_MAXSUBS; ++i){
+		int fd = efd + 1;
+		__atomic_compare_exchange_n(&subscribers[i], &fd, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * Wait for a frame newer than given
+ * @param lastseen - number of last frame reader got (0 for any frame)
+ * @param timeout  - max waiting time in milliseconds
+ * @return frame (put it back by framebuf_put) or NULL if timeout
+ */
+imframe *framebuf_wait(uint64_t lastseen, int timeout){
+	struct timespec now, end, rest;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += timeout / 1000;
+	end.tv_nsec += (timeout % 1000) * 1000000L;
+	if(end.tv_nsec >= 1000000000L){
+		++end.tv_sec;
+		end.tv_nsec -= 1000000000L;
+	}
+	while(1){
+		uint32_t seq = ATOMIC_LOAD(pubseq);
+		imframe *f = framebuf_get();
+		if(f && f->id > lastseen) return f;
+		framebuf_put(f);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		rest.tv_sec = end.tv_sec - now.tv_sec;
+		rest.tv_nsec = end.tv_nsec - now.tv_nsec;
+		if(rest.tv_nsec < 0){
+			--rest.tv_sec;
+			rest.tv_nsec += 1000000000L;
+		}
+		if(rest.tv_sec < 0) return NULL;
+		// if frame was published after we read pubseq, futex returns at once
+		ATOMIC_INC(nwaiters);
+		syscall(SYS_futex, &pubseq, FUTEX_WAIT_PRIVATE, seq, &rest, NULL, 0);
+		ATOMIC_DEC(nwaiters);
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * framebuf.h - lock-free publication of captured frames
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __FRAMEBUF_H__
+#define __FRAMEBUF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// amount of frame slots: the latest one, the one being written and frames held by readers
+#ifndef FRAMEBUF_SLOTS
+	#define FRAMEBUF_SLOTS			8
+#endif
+
+// max amount of eventfd's signalled on each publication
+#ifndef FRAMEBUF_MAXSUBS
+	#define FRAMEBUF_MAXSUBS		4
+#endif
+
+typedef struct{
+	uint64_t id;       // frame number (starting from 1)
+	double stamp;      // time of publication (dtime())
+	double captured;   // time of capture of the last summed frame
+	int w, h;          // image size
+	uint8_t *data;     // GRAY8 image w x h
+	size_t size;       // allocated size of data
+	int refcnt;        // users of this slot (writer or readers), don't touch!
+} imframe;
+
+// writer side
+imframe *framebuf_claim(int w, int h);
+void framebuf_publish(imframe *f);
+void framebuf_drop(imframe *f);
+// reader side
+imframe *framebuf_get();
+imframe *framebuf_ref(imframe *f);
+void framebuf_put(imframe *f);
+uint64_t framebuf_lastid();
+imframe *framebuf_wait(uint64_t lastseen, int timeout);
+int framebuf_subscribe(int efd);
+void framebuf_unsubscribe(int efd);
+
+#endif // __FRAMEBUF_H__
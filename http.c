@@ -0,0 +1,169 @@
+/*
+ * http.c - incremental parser of HTTP/1.x requests
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Parser works over connection's input buffer without any allocations and
+ * without modifying it. Until the empty line ending the header arrives only the
+ * new data is scanned (position is kept in *scanned), so request split across
+ * many reads costs the same as one read. Request is parsed only once, when it's
+ * complete; its length is returned, so the next pipelined request starts right
+ * after it.
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "http.h"
+
+static const struct{
+	const char *name;
+	size_t len;
+	httpmethod method;
+} methods[] = {
+	{"GET ", 4, HTTP_GET},
+	{"HEAD ", 5, HTTP_HEAD},
+	{"POST ", 5, HTTP_POST},
+	{"PUT ", 4, HTTP_PUT},
+	{NULL, 0, HTTP_NONE}
+};
+
+// @return end of line started at p (pointer to '\n') or NULL
+static const char *eol(const char *p, const char *end){
+	return memchr(p, '\n', end - p);
+}
+
+// length of line without CR/LF
+static size_t linelen(const char *p, const char *nl){
+	if(nl > p && nl[-1] == '\r') --nl;
+	return nl - p;
+}
+
+// check whether comma-separated list [p, end) contains token
+static int hastoken(const char *p, const char *end, const char *token){
+	size_t l = strlen(token);
+	while(p < end){
+		while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+		const char *e = p;
+		while(e < end && *e != ',') ++e;
+		const char *t = e;
+		while(t > p && (t[-1] == ' ' || t[-1] == '\t')) --t;
+		if((size_t)(t - p) == l && strncasecmp(p, token, l) == 0) return 1;
+		p = e;
+	}
+	return 0;
+}
+
+// parse request line "METHOD target HTTP/1.x"
+static int reqline(const char *p, const char *end, httpreq *req){
+	const char *t, *sp;
+	int i;
+	for(i = 0; methods[i].name; ++i)
+		if(strncmp(p, methods[i].name, methods[i].len) == 0) break;
+	req->method = methods[i].method;
+	t = p + methods[i].len;
+	if(!(sp = memchr(t, ' ', end - t))) return 0;
+	if(sp == t || (size_t)(sp - t) >= HTTP_MAXTARGET) return 0;
+	memcpy(req->target, t, sp - t);
+	req->target[sp - t] = 0;
+	++sp;
+	if(end - sp != 8 || strncmp(sp, "HTTP/1.", 7) || !isdigit((unsigned char)sp[7])) return 0;
+	req->minor = sp[7] - '0';
+	req->keepalive = (req->minor > 0); // HTTP/1.0 closes connection by default
+	return 1;
+}
+
+// parse header line "Name: value"
+static int header(const char *p, const char *end, httpreq *req){
+	const char *c = memchr(p, ':', end - p);
+	if(!c || c == p) return 0;
+	size_t nlen = c - p;
+	for(++c; c < end && (*c == ' ' || *c == '\t'); ++c);
+	if(nlen == 10 && strncasecmp(p, "Connection", 10) == 0){
+		if(hastoken(c, end, "close")) req->keepalive = 0;
+		else if(hastoken(c, end, "keep-alive")) req->keepalive = 1;
+	}else if(nlen == 14 && strncasecmp(p, "Content-Length", 14) == 0){
+		char num[16];
+		char *ep;
+		size_t l = end - c;
+		if(l == 0 || l >= sizeof(num)) return 0;
+		memcpy(num, c, l);
+		num[l] = 0;
+		long v = strtol(num, &ep, 10);
+		if(*ep || v < 0) return 0;
+		req->bodylen = (size_t)v;
+	}
+	return 1;
+}
+
+/**
+ * Parse request in the beginning of buffer
+ * @param buf     - connection's input data
+ * @param len     - its length
+ * @param scanned - amount of bytes already checked for the end of header (0 for new request)
+ * @param req     - parsed request (filled when header is complete, even if body isn't received)
+ * @return length of complete request, HTTP_INCOMPLETE if more data needed,
+ *         HTTP_NOTHTTP if buffer doesn't start with HTTP method, HTTP_BADREQ if it's malformed
+ *         or HTTP_TOOLARGE if its body is longer than HTTP_MAXBODY
+ */
+int http_parse(const char *buf, size_t len, size_t *scanned, httpreq *req){
+	const char *end = buf + len, *p, *nl, *hdrend = NULL;
+	int i, ismethod = 0;
+	if(*scanned == 0){ // check method
+		for(i = 0; methods[i].name; ++i){
+			size_t l = methods[i].len;
+			if(len < l){ // could be the beginning of method name
+				if(strncmp(buf, methods[i].name, len) == 0) ismethod = 1;
+			}else if(strncmp(buf, methods[i].name, l) == 0){
+				ismethod = 2;
+				break;
+			}
+		}
+		if(!ismethod) return HTTP_NOTHTTP;
+		if(ismethod == 1) return HTTP_INCOMPLETE;
+	}
+	// search an empty line after last scanned data
+	p = buf + ((*scanned > 3) ? *scanned - 3 : 0);
+	while((nl = eol(p, end))){
+		if(nl + 1 < end && nl[1] == '\n'){ hdrend = nl + 2; break; }
+		if(nl + 2 < end && nl[1] == '\r' && nl[2] == '\n'){ hdrend = nl + 3; break; }
+		p = nl + 1;
+	}
+	if(!hdrend){
+		*scanned = len ? len : 1;
+		return HTTP_INCOMPLETE;
+	}
+	*scanned = hdrend - buf;
+	// parse the header
+	memset(req, 0, sizeof(httpreq));
+	nl = eol(buf, end);
+	if(!reqline(buf, buf + linelen(buf, nl), req)) return HTTP_BADREQ;
+	for(p = nl + 1; p < hdrend; p = nl + 1){
+		nl = eol(p, end);
+		size_t l = linelen(p, nl);
+		if(!l) break; // empty line
+		if(!header(p, p + l, req)) return HTTP_BADREQ;
+	}
+	if(req->bodylen > HTTP_MAXBODY) return HTTP_TOOLARGE;
+	if((size_t)(hdrend - buf) + req->bodylen > len) return HTTP_INCOMPLETE; // wait for body
+	return (int)(hdrend - buf + req->bodylen);
+}
@@ -0,0 +1,61 @@
+/*
+ * http.h - incremental parser of HTTP/1.x requests
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include <stddef.h>
+
+// max length of request target (longer requests are rejected)
+#ifndef HTTP_MAXTARGET
+	#define HTTP_MAXTARGET			(256)
+#endif
+// max value of Content-Length we agree to skip (header and body should fit into NET_RBUFLEN)
+#ifndef HTTP_MAXBODY
+	#define HTTP_MAXBODY			(1024)
+#endif
+
+typedef enum{
+	HTTP_NONE = 0,  // not HTTP: regular socket query
+	HTTP_GET,
+	HTTP_HEAD,
+	HTTP_POST,
+	HTTP_PUT
+} httpmethod;
+
+typedef struct{
+	httpmethod method;
+	char target[HTTP_MAXTARGET]; // "/name.suffix"
+	int minor;                   // HTTP/1.minor
+	int keepalive;               // whether connection persists after reply
+	size_t bodylen;              // Content-Length
+} httpreq;
+
+// results of http_parse
+#define HTTP_INCOMPLETE     (0)
+#define HTTP_BADREQ         (-1)
+#define HTTP_NOTHTTP        (-2)
+#define HTTP_TOOLARGE       (-3)
+
+int http_parse(const char *buf, size_t len, size_t *scanned, httpreq *req);
+
+#endif // __HTTP_H__
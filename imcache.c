@@ -0,0 +1,353 @@
+/*
+ * imcache.c - cache of encoded frames shared by all clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Each frame is encoded only once for each set of parameters: the first client
+ * asking for it inserts an empty record and gives it to encoding threads (or
+ * encodes it by itself outside of lock), all others are added to its waiters
+ * (or wait for the result). So identical pending jobs are merged into one.
+ * Thread needing image which is still waiting in the pool encodes it at once.
+ * Records for old frames are thrown away as soon as a newer frame appears;
+ * those who still use them hold references.
+ * ROI, binned and downscaled images are made once as raw records, encoders of
+ * the same parameters take them as input.
+ */
+
+#include "main.h"
+#include "binning.h"
+#include "bufpool.h"
+#include "encpool.h"
+#include "jpegenc.h"
+#include "imcache.h"
+#include "pngenc.h"
+#include "rice.h"
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static encimage *cache = NULL;  // list of records
+static encimage *unused = NULL; // released records for reuse
+static uint64_t cacheid = 0;    // the newest frame in cache
+// statistics of encoding by image types
+static uint64_t nencoded[IMTYPE_RICE + 1];
+static double enctotal[IMTYPE_RICE + 1], enclast[IMTYPE_RICE + 1];
+
+static int samekey(const enckey *a, const enckey *b){
+	return (a->frameid == b->frameid && a->imtype == b->imtype &&
+		a->quality == b->quality && a->dct == b->dct && a->level == b->level &&
+		a->filter == b->filter && a->x == b->x && a->y == b->y &&
+		a->w == b->w && a->h == b->h && a->bin == b->bin && a->width == b->width &&
+		a->binsum == b->binsum);
+}
+
+// release record, cache_mutex should be locked
+static void unref(encimage *e){
+	if(--e->refcnt) return;
+	bufpool_put(e->data);
+	e->next = unused;
+	unused = e;
+}
+
+// remove records older than lastid, cache_mutex should be locked
+static void evict(uint64_t lastid){
+	encimage **pp = &cache;
+	if(lastid > cacheid) cacheid = lastid;
+	while(*pp){
+		encimage *e = *pp;
+		if(e->key.frameid < cacheid){
+			*pp = e->next;
+			unref(e);
+		}else pp = &e->next;
+	}
+}
+
+// fit ROI into frame W x H (ROI equal to the whole frame is marked as w == 0),
+// binning or scaling into ROI (both are zero if they don't change image);
+// wrong or useless for this type encoding parameters are zeroed (default)
+static void fitkey(enckey *key, int W, int H){
+	if(key->w > 0 && key->h > 0){
+		if(key->x < 0) key->x = 0;
+		else if(key->x >= W) key->x = W - 1;
+		if(key->y < 0) key->y = 0;
+		else if(key->y >= H) key->y = H - 1;
+		if(key->w > W - key->x) key->w = W - key->x;
+		if(key->h > H - key->y) key->h = H - key->y;
+		if(key->w == W && key->h == H) key->w = 0;
+	}
+	if(key->w > 0){
+		W = key->w;
+		H = key->h;
+	}else key->x = key->y = key->w = key->h = 0;
+	if(key->width > 0){ // scaling overrides binning
+		key->bin = 0;
+		if(key->width >= W) key->width = 0;
+		else if(key->width < (W + BIN_MAX - 1) / BIN_MAX) key->width = (W + BIN_MAX - 1) / BIN_MAX;
+	}else{
+		key->width = 0;
+		if(key->bin > BIN_MAX) key->bin = BIN_MAX;
+		if(key->bin > W) key->bin = W;
+		if(key->bin > H) key->bin = H;
+		if(key->bin < 2) key->bin = 0;
+	}
+	key->binsum = key->bin ? !!key->binsum : 0; // scaling always averages
+	if(key->imtype != IMTYPE_JPG || key->quality < 1 || key->quality > 100) key->quality = 0;
+	if(key->imtype != IMTYPE_JPG || key->dct < 0 || key->dct > JPEGENC_DCT_FLOAT) key->dct = 0;
+	if(key->imtype != IMTYPE_PNG || key->level < 1 || key->level > 9) key->level = 0;
+	if(key->imtype != IMTYPE_PNG || key->filter < 0 || key->filter > PNGENC_FILTER_AUTO) key->filter = 0;
+}
+
+// make raw image of ROI, binned or scaled if needed
+static void transform(imframe *frame, encimage *e){
+	const enckey *key = &e->key;
+	const uint8_t *src = frame->data;
+	int w = frame->w, h = frame->h;
+	if(key->w){
+		src += (size_t)key->y * frame->w + key->x;
+		w = key->w;
+		h = key->h;
+	}
+	if(key->bin){
+		e->w = w / key->bin;
+		e->h = h / key->bin;
+		// remainder of image is thrown away
+		e->data = binning(src, frame->w, e->w * key->bin, e->h * key->bin, e->w, e->h, key->binsum);
+	}else if(key->width){
+		e->w = key->width;
+		e->h = (int)(((int64_t)h * key->width + w / 2) / w);
+		if(e->h < (h + BIN_MAX - 1) / BIN_MAX) e->h = (h + BIN_MAX - 1) / BIN_MAX;
+		e->data = binning(src, frame->w, w, h, e->w, e->h, 0);
+	}else{ // copy ROI
+		uint8_t *out = e->data = bufpool_get((size_t)w * (size_t)h);
+		int i;
+		for(i = 0; i < h; ++i, src += frame->w, out += w)
+			memcpy(out, src, w);
+		e->w = w;
+		e->h = h;
+	}
+	e->len = (size_t)e->w * (size_t)e->h;
+}
+
+static void encode(imframe *frame, encimage *e){
+	encimage *raw = NULL;
+	uint8_t *data = frame->data;
+	e->w = frame->w;
+	e->h = frame->h;
+	if(e->key.w || e->key.bin || e->key.width){ // ROI, binned or scaled image
+		if(e->key.imtype == IMTYPE_RAW){
+			transform(frame, e);
+			return;
+		}
+		// encode raw image shared with others
+		enckey rawkey = e->key;
+		rawkey.imtype = IMTYPE_RAW;
+		if(!(raw = imcache_get(frame, &rawkey))){
+			e->data = NULL;
+			return;
+		}
+		data = raw->data;
+		e->w = raw->w;
+		e->h = raw->h;
+	}
+	switch(e->key.imtype){
+		case IMTYPE_JPG:
+			e->data = jpegenc(&e->len, e->w, e->h, data, e->key.quality, e->key.dct);
+		break;
+		case IMTYPE_PNG:
+			e->data = pngenc(&e->len, e->w, e->h, data, e->key.level, e->key.filter);
+		break;
+		case IMTYPE_RICE:
+			e->data = bufpool_get(rice_bound(e->w, e->h));
+			e->len = rice_encode(e->data, e->w, e->h, data);
+		break;
+		case IMTYPE_RAW: // no copy: framebuf won't overwrite referenced data
+			e->len = (size_t)e->w * (size_t)e->h;
+			e->data = bufpool_ref(data);
+		break;
+		default:
+			e->data = NULL;
+	}
+	imcache_put(raw);
+}
+
+// find record or insert a new one; it's referenced by caller; cache_mutex should be locked
+static encimage *lookup(imframe *frame, enckey *key, int *isnew){
+	encimage *e;
+	key->frameid = frame->id;
+	fitkey(key, frame->w, frame->h);
+	evict(frame->id);
+	for(e = cache; e; e = e->next)
+		if(samekey(&e->key, key)) break;
+	if(e){ // somebody already encodes or encoded this
+		++e->refcnt;
+		*isnew = 0;
+		return e;
+	}
+	if((e = unused)){
+		unused = e->next;
+		memset(e, 0, sizeof(encimage));
+	}else e = MALLOC(encimage, 1);
+	e->key = *key;
+	e->refcnt = 2; // cache & caller
+	e->next = cache;
+	cache = e;
+	*isnew = 1;
+	return e;
+}
+
+// encode image taken for encoding and give it to waiters
+static void runencode(imframe *frame, encimage *e){
+	encwaiter *w, *nxt;
+	double t0 = dtime();
+	encode(frame, e);
+	e->enctime = dtime() - t0;
+	pthread_mutex_lock(&cache_mutex);
+	e->ready = e->data ? 1 : -1;
+	if(e->data && e->key.imtype <= IMTYPE_RICE){
+		++nencoded[e->key.imtype];
+		enctotal[e->key.imtype] += e->enctime;
+		enclast[e->key.imtype] = e->enctime;
+	}
+	pthread_cond_broadcast(&cache_cond);
+	framebuf_put(e->frame);
+	e->frame = NULL;
+	w = e->waiters;
+	e->waiters = NULL;
+	for(nxt = w; nxt; nxt = nxt->next){
+		if(e->ready > 0) nxt->enc = e;
+		else{ // waiters' references are useless
+			nxt->enc = NULL;
+			unref(e);
+		}
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	for(; w; w = nxt){
+		nxt = w->next; // waiter could be reused after notification
+		w->ready(w);
+	}
+}
+
+// task of encoding thread
+static void encjob(void *arg){
+	encimage *e = arg;
+	pthread_mutex_lock(&cache_mutex);
+	int taken = e->encoding;
+	e->encoding = 1;
+	pthread_mutex_unlock(&cache_mutex);
+	if(!taken) runencode(e->frame, e);
+	imcache_put(e); // reference of task
+}
+
+/**
+ * Get encoded image for given frame, encode it if nobody did it before
+ * @param frame - frame to encode (got from framebuf)
+ * @param key   - encoding parameters, key->frameid is filled here, ROI is fitted
+ *                into frame (w == 0 if ROI is absent or covers whole frame),
+ *                binning and scaling are fitted into ROI
+ * @return encoded image (release it by imcache_put) or NULL in case of error
+ */
+encimage *imcache_get(imframe *frame, enckey *key){
+	encimage *e;
+	int isnew;
+	pthread_mutex_lock(&cache_mutex);
+	e = lookup(frame, key, &isnew);
+	if(!e->ready && !e->encoding){ // new or still waits in the pool: encode it here
+		e->encoding = 1;
+		pthread_mutex_unlock(&cache_mutex);
+		runencode(frame, e);
+		pthread_mutex_lock(&cache_mutex);
+	}else while(!e->ready) pthread_cond_wait(&cache_cond, &cache_mutex);
+	if(e->ready < 0){
+		unref(e);
+		e = NULL;
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	return e;
+}
+
+/**
+ * Get encoded image without waiting: if it isn't ready, it's encoded by pool threads
+ * @param frame - frame to encode (got from framebuf; could be released after call)
+ * @param key   - encoding parameters (see imcache_get)
+ * @param w     - waiter: w->enc is result (release it by imcache_put),
+ *                w->ready() is called when it's ready if function returned 0
+ * @return 1 if result is ready at once, 0 if w->ready() will be called
+ */
+int imcache_submit(imframe *frame, enckey *key, encwaiter *w){
+	encimage *e;
+	int isnew;
+	pthread_mutex_lock(&cache_mutex);
+	e = lookup(frame, key, &isnew);
+	if(e->ready){
+		if(e->ready < 0){
+			unref(e);
+			e = NULL;
+		}
+		w->enc = e;
+		pthread_mutex_unlock(&cache_mutex);
+		return 1;
+	}
+	w->enc = NULL;
+	w->next = e->waiters;
+	e->waiters = w;
+	if(isnew){
+		e->frame = framebuf_ref(frame);
+		++e->refcnt; // task
+	}
+	pthread_mutex_unlock(&cache_mutex);
+	if(isnew) encpool_submit(encjob, e);
+	return 0;
+}
+
+/**
+ * Get statistics of encoding
+ * @param t         - image type
+ * @param n (o)     - amount of images encoded
+ * @param total (o) - total time of their encoding (seconds)
+ * @param last (o)  - time of the last one
+ */
+void imcache_stats(imagetype t, uint64_t *n, double *total, double *last){
+	if(t > IMTYPE_RICE) t = IMTYPE_NONE;
+	pthread_mutex_lock(&cache_mutex);
+	*n = nencoded[t];
+	*total = enctotal[t];
+	*last = enclast[t];
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Release image got by imcache_get
+ * @param e - image
+ */
+void imcache_put(encimage *e){
+	if(!e) return;
+	pthread_mutex_lock(&cache_mutex);
+	unref(e);
+	pthread_mutex_unlock(&cache_mutex);
+}
+
+/**
+ * Throw away images of frames older than lastid; never blocks
+ * @param lastid - number of the latest published frame
+ */
+void imcache_evict(uint64_t lastid){
+	if(pthread_mutex_trylock(&cache_mutex)) return; // will be done in imcache_get
+	evict(lastid);
+	pthread_mutex_unlock(&cache_mutex);
+}
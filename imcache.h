@@ -0,0 +1,83 @@
+/*
+ * imcache.h - cache of encoded frames shared by all clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __IMCACHE_H__
+#define __IMCACHE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "framebuf.h"
+
+typedef enum{
+	IMTYPE_NONE = 0,
+	IMTYPE_RAW,
+	IMTYPE_JPG,
+	IMTYPE_PNG,
+	IMTYPE_RICE         // lossless compressed raw (rice.h)
+} imagetype;
+
+// what should be done with a frame: the cache key
+typedef struct{
+	uint64_t frameid;   // frame number (filled by imcache_get)
+	imagetype imtype;   // output format
+	int quality;        // JPEG quality (0 - default)
+	int dct;            // JPEG DCT method (jpegdct)
+	int level;          // PNG compression level (0 - default)
+	int filter;         // PNG row filter (pngfilter)
+	int x, y, w, h;     // region of interest (w == 0 - full frame)
+	int bin;            // binning of ROI (0 or 1 - none)
+	int width;          // or width of downscaled ROI (0 - no scaling)
+	int binsum;         // sum binned pixels instead of averaging (saturating)
+} enckey;
+
+struct encimage;
+
+// who waits for image submitted to encoding threads
+typedef struct encwaiter{
+	struct encimage *enc;   // result (NULL in case of error)
+	void (*ready)(struct encwaiter *w); // called by encoding thread when result is ready
+	struct encwaiter *next;
+} encwaiter;
+
+// encoded image, shared by all its users
+typedef struct encimage{
+	enckey key;
+	uint8_t *data;      // encoded image
+	size_t len;         // its length
+	int w, h;           // size of image
+	int ready;          // 0 - still encoding, 1 - ready, -1 - error
+	double enctime;     // time of encoding (seconds)
+	int encoding;       // somebody took it for encoding
+	imframe *frame;     // frame to encode (while it waits for encoding thread)
+	encwaiter *waiters; // those who wait for it
+	int refcnt;         // amount of users (including cache itself)
+	struct encimage *next;
+} encimage;
+
+encimage *imcache_get(imframe *frame, enckey *key);
+int imcache_submit(imframe *frame, enckey *key, encwaiter *w);
+void imcache_stats(imagetype t, uint64_t *n, double *total, double *last);
+void imcache_put(encimage *e);
+void imcache_evict(uint64_t lastid);
+
+#endif // __IMCACHE_H__
@@ -0,0 +1,297 @@
+/*
+ * jpegenc.c - JPEG encoder of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Each thread has its own compressor created at the first call: libjpeg
+ * structures and output buffer of the worst-case size (as tjBufSize() of
+ * TurboJPEG: 2 bytes per pixel of image padded to MCU, plus headers), so
+ * libjpeg never asks for more memory. Encoded image is copied into pool buffer
+ * of its exact size. Errors of libjpeg return here through longjmp instead of
+ * exit().
+ *
+ * Large images are cut into horizontal stripes of whole MCU rows encoded by
+ * threads of encpool. Each stripe is a separate JPEG with restart interval equal
+ * to the amount of its MCUs, so its entropy-coded data is exactly one restart
+ * interval: it starts with zero DC predictions and ends on byte boundary. Joined
+ * image is header of the first stripe (with full height) and data of all stripes
+ * separated by RSTn markers. Tables are default ones, the same for all stripes.
+ */
+
+#include "main.h" // stdio.h goes before jpeglib.h
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+#include "bufpool.h"
+#include "encpool.h"
+#include "jpegenc.h"
+
+#define PAD(x, a)   (((x) + (a) - 1) / (a) * (a))
+// worst-case size of encoded w x h image
+#define JPEGSIZE(w, h)  (PAD((size_t)(w), 8) * PAD((size_t)(h), 8) * 2 + 2048)
+
+typedef struct{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_destination_mgr dest;
+	jmp_buf jmp;
+	uint8_t *out;       // current output buffer
+	size_t outsize;
+	uint8_t *buf;       // own output buffer
+	size_t bufsize;
+} compressor;
+
+// parameters of image encoding by stripes
+typedef struct{
+	int w, quality;
+	jpegdct dct;
+	unsigned restart;   // MCUs in stripe
+} stripejob;
+
+typedef struct{
+	const stripejob *job;
+	const uint8_t *data;
+	int h;              // amount of rows
+	uint8_t *out;       // output buffer of JPEGSIZE(w, h) size
+	size_t len;         // size of encoded stripe (0 - error)
+} stripe;
+
+static pthread_key_t compkey;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void freecomp(void *arg){
+	compressor *c = arg;
+	jpeg_destroy_compress(&c->cinfo);
+	FREE(c->buf);
+	FREE(c);
+}
+
+static void makekey(){
+	if(pthread_key_create(&compkey, freecomp)) ERR("pthread_key_create()");
+}
+
+static void error_exit(j_common_ptr cinfo){
+	compressor *c = (compressor*)cinfo; // cinfo is the first field
+	char msg[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, msg);
+	WARNX("libjpeg: %s", msg);
+	longjmp(c->jmp, 1);
+}
+
+static void init_destination(j_compress_ptr cinfo){
+	compressor *c = (compressor*)cinfo;
+	c->dest.next_output_byte = c->out;
+	c->dest.free_in_buffer = c->outsize;
+}
+
+// never happens: buffer has the worst-case size
+static boolean empty_output_buffer(j_compress_ptr cinfo){
+	ERREXIT(cinfo, JERR_BUFFER_SIZE);
+	return FALSE;
+}
+
+static void term_destination(_U_ j_compress_ptr cinfo){}
+
+// compressor of current thread
+static compressor *getcomp(){
+	compressor *c;
+	pthread_once(&key_once, makekey);
+	if((c = pthread_getspecific(compkey))) return c;
+	c = MALLOC(compressor, 1);
+	c->cinfo.err = jpeg_std_error(&c->jerr);
+	c->jerr.error_exit = error_exit;
+	jpeg_create_compress(&c->cinfo);
+	c->dest.init_destination = init_destination;
+	c->dest.empty_output_buffer = empty_output_buffer;
+	c->dest.term_destination = term_destination;
+	c->cinfo.dest = &c->dest;
+	pthread_setspecific(compkey, c);
+	return c;
+}
+
+/**
+ * Encode image into given buffer
+ * @param out, outsize - output buffer (not less than JPEGSIZE(w, h))
+ * @param restart      - restart interval in MCUs (0 - none)
+ * @return size of encoded image or 0
+ */
+static size_t compress(uint8_t *out, size_t outsize, int w, int h, const uint8_t *data,
+						int quality, jpegdct dct, unsigned restart){
+	compressor *c = getcomp();
+	struct jpeg_compress_struct *cinfo = &c->cinfo;
+	JSAMPROW rows[JPEGENC_ROWS];
+	int i;
+	c->out = out;
+	c->outsize = outsize;
+	if(setjmp(c->jmp)){
+		jpeg_abort_compress(cinfo);
+		return 0;
+	}
+	cinfo->image_width      = w;
+	cinfo->image_height     = h;
+	cinfo->input_components = 1;
+	cinfo->in_color_space   = JCS_GRAYSCALE;
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, quality, TRUE);
+	cinfo->restart_interval = restart;
+	switch(dct){
+		case JPEGENC_DCT_FAST:
+			cinfo->dct_method = JDCT_IFAST;
+		break;
+		case JPEGENC_DCT_FLOAT:
+			cinfo->dct_method = JDCT_FLOAT;
+		break;
+		default:
+			cinfo->dct_method = JDCT_ISLOW;
+	}
+	jpeg_start_compress(cinfo, TRUE);
+	while(cinfo->next_scanline < cinfo->image_height){
+		int n = (int)(cinfo->image_height - cinfo->next_scanline);
+		if(n > JPEGENC_ROWS) n = JPEGENC_ROWS;
+		for(i = 0; i < n; ++i)
+			rows[i] = (JSAMPROW)(data + (size_t)(cinfo->next_scanline + i) * w);
+		jpeg_write_scanlines(cinfo, rows, n);
+	}
+	jpeg_finish_compress(cinfo);
+	return c->outsize - c->dest.free_in_buffer;
+}
+
+// encode one stripe (subtask of encpool)
+static void stripetask(void *arg){
+	stripe *s = arg;
+	const stripejob *j = s->job;
+	s->len = compress(s->out, JPEGSIZE(j->w, s->h), j->w, s->h, s->data, j->quality, j->dct, j->restart);
+}
+
+/**
+ * Find entropy-coded data of JPEG
+ * @param jpeg, len - encoded image
+ * @param sof (o)   - position of SOF0 marker
+ * @return position of data after SOS header or 0 if not found
+ */
+static size_t scandata(const uint8_t *jpeg, size_t len, size_t *sof){
+	size_t p = 2; // after SOI
+	*sof = 0;
+	while(p + 4 <= len && jpeg[p] == 0xFF){
+		uint8_t marker = jpeg[p + 1];
+		if(marker == 0xC0) *sof = p;
+		p += 2 + (((size_t)jpeg[p + 2] << 8) | jpeg[p + 3]);
+		if(marker == 0xDA) return (*sof && p + 2 <= len) ? p : 0;
+	}
+	return 0;
+}
+
+/**
+ * Encode image by stripes in parallel
+ * @return pool buffer or NULL if image is too small or pool isn't running
+ */
+static uint8_t *encstripes(size_t *size, int w, int h, const uint8_t *data, int quality, jpegdct dct){
+	stripejob job;
+	stripe stripes[JPEGENC_MAXSTRIPES];
+	uint8_t *buf, *out, *o;
+	size_t sz, total, start[JPEGENC_MAXSTRIPES], sof;
+	int i, n, rows, maxrows, mcux = (w + 7) / 8;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	n = encpool_threads();
+	if(cpus > 0 && n > cpus) n = (int)cpus; // no sense to cut image for one CPU
+	if(n > JPEGENC_MAXSTRIPES) n = JPEGENC_MAXSTRIPES;
+	if((size_t)w * h / JPEGENC_STRIPEPIX < (size_t)n) n = (int)((size_t)w * h / JPEGENC_STRIPEPIX);
+	if(n < 2) return NULL;
+	rows = PAD((h + n - 1) / n, 8);
+	maxrows = 65535 / mcux * 8; // restart interval is 16-bit
+	if(rows > maxrows) rows = maxrows;
+	if(rows < 8) return NULL;
+	n = (h + rows - 1) / rows;
+	if(n < 2 || n > JPEGENC_MAXSTRIPES) return NULL;
+	sz = JPEGSIZE(w, rows);
+	buf = bufpool_get(sz * n);
+	job.w = w;
+	job.quality = quality;
+	job.dct = dct;
+	job.restart = (unsigned)(mcux * rows / 8);
+	for(i = 0; i < n; ++i){
+		stripe *s = &stripes[i];
+		s->job = &job;
+		s->data = data + (size_t)i * rows * w;
+		s->h = (i == n - 1) ? h - i * rows : rows;
+		s->out = buf + sz * i;
+		s->len = 0;
+	}
+	encpool_forkjoin(stripetask, stripes, sizeof(stripe), n);
+	// join stripes: header of the first one, data of all, RSTn between them
+	total = 0;
+	for(i = 0; i < n; ++i){
+		stripe *s = &stripes[i];
+		if(!s->len || !(start[i] = scandata(s->out, s->len, &sof))) break;
+		total += s->len - start[i]; // data + RSTn or EOI
+	}
+	if(i < n){
+		WARNX("Can't encode stripe %d", i);
+		bufpool_put(buf);
+		return NULL;
+	}
+	scandata(buf, stripes[0].len, &sof);
+	total += start[0];
+	out = o = bufpool_get(total);
+	memcpy(o, buf, start[0]);
+	o[sof + 5] = (uint8_t)(h >> 8); // SOF0: marker, length, precision, height
+	o[sof + 6] = (uint8_t)h;
+	o += start[0];
+	for(i = 0; i < n; ++i){
+		stripe *s = &stripes[i];
+		size_t L = s->len - start[i] - 2;
+		memcpy(o, s->out + start[i], L);
+		o += L;
+		*o++ = 0xFF;
+		*o++ = (i == n - 1) ? 0xD9 : (uint8_t)(0xD0 + i % 8);
+	}
+	bufpool_put(buf);
+	*size = total;
+	return out;
+}
+
+/**
+ * Encode GRAY8 image into JPEG
+ * @param size (o) - size of encoded image
+ * @param w, h     - image size
+ * @param data     - image
+ * @param quality  - quality 1..100 (0 - JPEGENC_QUALITY)
+ * @param dct      - DCT method
+ * @return pool buffer (release it by bufpool_put) or NULL
+ */
+uint8_t *jpegenc(size_t *size, int w, int h, const uint8_t *data, int quality, jpegdct dct){
+	compressor *c;
+	size_t need = JPEGSIZE(w, h);
+	uint8_t *out;
+	*size = 0;
+	if(quality < 1 || quality > 100) quality = JPEGENC_QUALITY;
+	if((out = encstripes(size, w, h, data, quality, dct))) return out;
+	c = getcomp();
+	if(c->bufsize < need){
+		FREE(c->buf);
+		c->buf = MALLOC(uint8_t, need);
+		c->bufsize = need;
+	}
+	if(!(*size = compress(c->buf, need, w, h, data, quality, dct, 0))) return NULL;
+	out = bufpool_get(*size);
+	memcpy(out, c->buf, *size);
+	return out;
+}
@@ -0,0 +1,59 @@
+/*
+ * jpegenc.h - JPEG encoder of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __JPEGENC_H__
+#define __JPEGENC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// default quality
+#ifndef JPEGENC_QUALITY
+	#define JPEGENC_QUALITY			(60)
+#endif
+
+// amount of rows given to libjpeg at once
+#ifndef JPEGENC_ROWS
+	#define JPEGENC_ROWS			(16)
+#endif
+
+// max amount of stripes encoded in parallel
+#ifndef JPEGENC_MAXSTRIPES
+	#define JPEGENC_MAXSTRIPES		(16)
+#endif
+
+// min amount of pixels in stripe (smaller images are encoded by one thread)
+#ifndef JPEGENC_STRIPEPIX
+	#define JPEGENC_STRIPEPIX		(65536)
+#endif
+
+// DCT methods
+typedef enum{
+	JPEGENC_DCT_DEFAULT = 0,    // accurate integer
+	JPEGENC_DCT_ISLOW,          // the same
+	JPEGENC_DCT_FAST,           // fast integer, less accurate
+	JPEGENC_DCT_FLOAT           // floating point
+} jpegdct;
+
+uint8_t *jpegenc(size_t *size, int w, int h, const uint8_t *data, int quality, jpegdct dct);
+
+#endif // __JPEGENC_H__
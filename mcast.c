@@ -0,0 +1,170 @@
+/*
+ * mcast.c - distribution of raw frames through UDP multicast
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Sender thread waits for each new frame and sends it to multicast group
+ * directly from frame slot: header and payload of each datagram are given by
+ * iovec, datagrams are sent by batches through sendmmsg. So egress doesn't
+ * depend on amount of receivers. Datagram format is described in proto.h.
+ */
+
+#define _GNU_SOURCE // sendmmsg
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <endian.h>
+
+#include "main.h"
+#include "framebuf.h"
+#include "mcast.h"
+#include "proto.h"
+
+static int msock = -1;
+static struct sockaddr_in group;
+static pthread_t mthread;
+static volatile int mcast_quit = 0;
+static uint32_t dgramseq = 0;
+
+// send frame by fragments; @return 0 if failure
+static int sendframe(imframe *f){
+	protodgram hdrs[MCAST_BATCH];
+	struct mmsghdr msgs[MCAST_BATCH];
+	struct iovec iovs[MCAST_BATCH][2];
+	size_t len = (size_t)f->w * (size_t)f->h, off = 0;
+	size_t nfrags = (len + PROTO_DGRAM_PAYLOAD - 1) / PROTO_DGRAM_PAYLOAD;
+	int i, n;
+	uint16_t frag = 0;
+	if(nfrags > UINT16_MAX){
+		DBG("Frame is too large for multicast");
+		return 0;
+	}
+	while(off < len){
+		for(n = 0; n < MCAST_BATCH && off < len; ++n){
+			size_t l = len - off;
+			if(l > PROTO_DGRAM_PAYLOAD) l = PROTO_DGRAM_PAYLOAD;
+			protodgram *h = &hdrs[n];
+			h->magic = htole32(PROTO_DGRAM_MAGIC);
+			h->version = PROTO_VERSION;
+			h->format = PROTO_FMT_GRAY8;
+			h->nfrags = htole16((uint16_t)nfrags);
+			h->width = htole32(f->w);
+			h->height = htole32(f->h);
+			h->frameid = htole64(f->id);
+			h->stamp = htole64((uint64_t)(f->captured * 1e6));
+			h->length = htole32((uint32_t)len);
+			h->offset = htole32((uint32_t)off);
+			h->seq = htole32(dgramseq++);
+			h->frag = htole16(frag++);
+			h->reserved = 0;
+			iovs[n][0].iov_base = h;
+			iovs[n][0].iov_len = sizeof(protodgram);
+			iovs[n][1].iov_base = f->data + off;
+			iovs[n][1].iov_len = l;
+			memset(&msgs[n], 0, sizeof(struct mmsghdr));
+			msgs[n].msg_hdr.msg_name = &group;
+			msgs[n].msg_hdr.msg_namelen = sizeof(group);
+			msgs[n].msg_hdr.msg_iov = iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 2;
+			off += l;
+		}
+		for(i = 0; i < n;){
+			int s = sendmmsg(msock, msgs + i, n - i, 0);
+			if(s < 0){
+				if(errno == EINTR) continue;
+				WARN("sendmmsg()");
+				return 0;
+			}
+			i += s;
+		}
+	}
+	return 1;
+}
+
+static void *sender(_U_ void *arg){
+	uint64_t last = 0;
+	while(!mcast_quit){
+		imframe *f = framebuf_wait(last, 500);
+		if(!f) continue;
+		last = f->id;
+		sendframe(f);
+		framebuf_put(f);
+	}
+	return NULL;
+}
+
+/**
+ * Start sending frames to multicast group
+ * @param spec - "group:port[:interface address]"
+ * @return 0 if failure
+ */
+int mcast_start(const char *spec){
+	char *str = strdup(spec), *port, *ifaddr = NULL;
+	struct in_addr iface = {.s_addr = htonl(INADDR_ANY)};
+	unsigned char ttl = MCAST_TTL;
+	int ret = 0;
+	memset(&group, 0, sizeof(group));
+	group.sin_family = AF_INET;
+	if((port = strchr(str, ':'))){
+		*port++ = 0;
+		if((ifaddr = strchr(port, ':'))) *ifaddr++ = 0;
+	}
+	if(!port || !inet_aton(str, &group.sin_addr) || !IN_MULTICAST(ntohl(group.sin_addr.s_addr))
+		|| atoi(port) < 1 || atoi(port) > 65535 || (ifaddr && !inet_aton(ifaddr, &iface))){
+		/// "Неверный адрес группы, должен быть group:port[:interface]"
+		WARNX(_("Wrong multicast address, should be group:port[:interface]"));
+		goto ret;
+	}
+	group.sin_port = htons(atoi(port));
+	if((msock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0){
+		WARN("socket()");
+		goto ret;
+	}
+	if(setsockopt(msock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) ||
+		setsockopt(msock, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface))){
+		WARN("setsockopt()");
+		goto ret;
+	}
+	mcast_quit = 0;
+	if(pthread_create(&mthread, NULL, sender, NULL)){
+		WARN("pthread_create()");
+		goto ret;
+	}
+	DBG("multicast to %s:%s", str, port);
+	ret = 1;
+ret:
+	if(!ret && msock > -1){
+		close(msock);
+		msock = -1;
+	}
+	FREE(str);
+	return ret;
+}
+
+/**
+ * Stop multicast sending
+ */
+void mcast_stop(){
+	if(msock < 0) return;
+	mcast_quit = 1;
+	pthread_join(mthread, NULL);
+	close(msock);
+	msock = -1;
+}
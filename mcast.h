@@ -0,0 +1,39 @@
+/*
+ * mcast.h - distribution of raw frames through UDP multicast
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __MCAST_H__
+#define __MCAST_H__
+
+// TTL of multicast datagrams
+#ifndef MCAST_TTL
+	#define MCAST_TTL				(1)
+#endif
+
+// max amount of datagrams sent by one sendmmsg
+#ifndef MCAST_BATCH
+	#define MCAST_BATCH				(64)
+#endif
+
+int mcast_start(const char *spec);
+void mcast_stop();
+
+#endif // __MCAST_H__
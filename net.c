@@ -0,0 +1,939 @@
+/*
+ * net.c - event loop serving clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * All sockets are non-blocking and served by one thread through epoll.
+ * Each connection is a small state machine:
+ *   CS_READ   - waiting for request;
+ *   CS_WAIT   - waiting for a frame newer than the last one sent (or timeout);
+ *   CS_ENCODE - frame is encoded by one of worker threads;
+ *   CS_WRITE  - reply is being sent.
+ * Publication of frames is signalled through eventfd subscribed to framebuf,
+ * images are encoded by encpool threads (or got from imcache at once if they're
+ * ready), encoded connections are returned through another eventfd.
+ * MJPEG streams (GET /stream.mjpg) return to CS_WAIT after each part is sent, so
+ * slow readers just skip frames published while they were writing; encoded
+ * frame is shared by all streams through imcache.
+ * So each connection has at most one reply in flight and the next one is always
+ * made of the latest frame: slow client never gets stale backlog and holds no
+ * more than one encoded image. Unsent data in socket buffer is limited by
+ * TCP_NOTSENT_LOWAT, otherwise kernel would hide slowness of client. Frames
+ * skipped between two replies are counted as dropped; counters of all clients
+ * are sent by "stats" query (GET /stats).
+ * Binary clients (see proto.h) could subscribe to frames: they are served like
+ * MJPEG streams, but also listened for next commands while waiting.
+ * Region of interest is sticky: it's kept by connection and applied to all next
+ * frames until changed (GET /roi?x=&y=&w=&h=, "roi=x,y,w,h" or PROTO_ROI), the
+ * same is for binning or downscaling (bin=, width= or PROTO_SCALE), JPEG
+ * quality (q=, dct=) and PNG compression (level=, filter=; both by PROTO_QUALITY).
+ */
+
+#define _GNU_SOURCE // accept4
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <limits.h>
+
+#include "main.h"
+#include "binning.h"
+#include "bufpool.h"
+#include "encpool.h"
+#include "framebuf.h"
+#include "http.h"
+#include "imcache.h"
+#include "jpegenc.h"
+#include "net.h"
+#include "pngenc.h"
+#include "proto.h"
+#include "shmring.h"
+
+#if HTTP_MAXBODY >= NET_RBUFLEN
+#error "HTTP_MAXBODY should be less than NET_RBUFLEN: request header is stored there too"
+#endif
+
+// first jpeg added for ability of writing imsuffixes[imtype]
+static const char *imsuffixes[] = { "jpeg", "raw", "jpg", "png", "rice", "mjpg", NULL };
+static const char *mimetypes[] = { "jpeg", "raw", "jpeg", "png", "x-rice"};
+static const imagetype suffixtypes[] = { IMTYPE_JPG, IMTYPE_RAW, IMTYPE_JPG, IMTYPE_PNG, IMTYPE_RICE, IMTYPE_JPG };
+// names of jpegdct values
+static const char *dctnames[] = { "default", "islow", "fast", "float", NULL };
+// names of pngfilter values
+static const char *filternames[] = { "default", "none", "sub", "up", "avg", "paeth", "auto", NULL };
+// suffix of MJPEG stream
+#define MJPEG_SUFFIX    "mjpg"
+#define MJPEG_BOUNDARY  "tvguideframe"
+
+typedef enum{
+	CS_READ,
+	CS_WAIT,
+	CS_ENCODE,
+	CS_WRITE
+} connstate;
+
+typedef struct conn{
+	int fd;
+	char peer[32];          // client's address
+	connstate state;
+	int closing;            // connection is closed, it will be freed after current events
+	int webquery;           // whether query is web or regular
+	int closeafter;         // close connection after reply
+	int head;               // HEAD request: send only header
+	int http10;             // HTTP/1.0 client (needs explicit keep-alive)
+	int inproc;             // input buffer is being processed
+	int stream;             // MJPEG stream: 1 - header not sent yet, 2 - sending parts
+	int binary;             // binary protocol client
+	imagetype imtype;       // requested format
+	enckey key;             // sticky encoding parameters (ROI)
+	uint64_t lastframe;     // number of last frame sent through this connection
+	double deadline;        // when to stop waiting for a new frame
+	encwaiter waiter;       // waiter of image encoded by pool
+	int x, y, w, h;         // position and size of image sent (ROI)
+	double captured;        // and time of capture
+	encimage *enc;          // encoded image being sent
+	char *text;             // or text reply
+	uint64_t delivered;     // amount of frames sent
+	uint64_t dropped;       // amount of frames skipped between sent ones
+	char rbuf[NET_RBUFLEN]; // input data
+	size_t rlen;            // its length
+	size_t scanned;         // part of rbuf checked by http_parse
+	char hdr[512];          // reply header
+	size_t hdrlen;
+	const uint8_t *body;    // reply body (or NULL)
+	size_t bodylen;
+	size_t sent;            // bytes of header + body sent
+	struct conn *prev, *next; // list of waiting connections
+	struct conn *qnext;     // list of encoded connections
+	struct conn *cnext;     // list of closed connections
+	struct conn *aprev, *anext; // list of all connections
+} conn;
+
+static int epfd = -1;
+static int framefd = -1;    // eventfd signalling new frames
+static int donefd = -1;     // eventfd signalling encoded frames
+// epoll markers of listening socket and eventfd's
+static char tok_listen, tok_frame, tok_done, tok_shm;
+static conn *waiting = NULL; // connections in CS_WAIT
+static conn *allconns = NULL; // all connections
+static conn *closed = NULL; // closed connections to free
+static int nconns = 0;
+
+static void processinput(conn *c);
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static conn *done = NULL;   // connections with encoded frames
+
+// called by encoding thread when image of connection is ready
+static void encready(encwaiter *w){
+	conn *c = (conn*)((char*)w - offsetof(conn, waiter));
+	pthread_mutex_lock(&done_mutex);
+	c->qnext = done;
+	done = c;
+	pthread_mutex_unlock(&done_mutex);
+	eventfd_write(donefd, 1);
+}
+
+static void setevents(conn *c, uint32_t events){
+	struct epoll_event ev = {.events = events, .data.ptr = c};
+	if(epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev)) WARN("epoll_ctl()");
+}
+
+static void unwait(conn *c){
+	if(c->state != CS_WAIT) return;
+	if(c->prev) c->prev->next = c->next;
+	else waiting = c->next;
+	if(c->next) c->next->prev = c->prev;
+	c->prev = c->next = NULL;
+}
+
+static void freeconn(conn *c){
+	DBG("%s: %llu frames delivered, %llu dropped", c->peer,
+		(unsigned long long)c->delivered, (unsigned long long)c->dropped);
+	if(c->aprev) c->aprev->anext = c->anext;
+	else allconns = c->anext;
+	if(c->anext) c->anext->aprev = c->aprev;
+	--nconns;
+	imcache_put(c->enc);
+	FREE(c->text);
+	FREE(c);
+}
+
+// free connection later: events of current epoll_wait could still point to it
+static void dropconn(conn *c){
+	c->cnext = closed;
+	closed = c;
+}
+
+// free connections dropped while processing events
+static void freeclosed(){
+	conn *c;
+	while((c = closed)){
+		closed = c->cnext;
+		freeconn(c);
+	}
+}
+
+static void closeconn(conn *c){
+	//DBG("close fd %d", c->fd);
+	if(c->closing) return;
+	unwait(c);
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	c->fd = -1;
+	c->closing = 1;
+	// else encoded() or processinput() will drop it
+	if(c->state != CS_ENCODE && !c->inproc) dropconn(c);
+}
+
+// put connection into list of waiting for a new frame
+static void waitframe(conn *c){
+	c->state = CS_WAIT;
+	c->deadline = dtime() + FRAME_TIMEOUT / 1000.;
+	c->prev = NULL;
+	if((c->next = waiting)) waiting->prev = c;
+	waiting = c;
+	if(c->binary && c->stream) setevents(c, EPOLLIN | EPOLLRDHUP); // subscriber could send commands
+	else if(c->stream) setevents(c, EPOLLRDHUP); // stream client can only close connection
+	else setevents(c, 0); // but watch for errors
+}
+
+// send the rest of reply; @return 0 if it isn't sent yet
+static int writereply(conn *c){
+	size_t total = c->hdrlen + c->bodylen;
+	while(c->sent < total){
+		struct iovec iov[2];
+		int n = 0;
+		if(c->sent < c->hdrlen){
+			iov[n].iov_base = c->hdr + c->sent;
+			iov[n++].iov_len = c->hdrlen - c->sent;
+		}
+		if(c->bodylen){
+			size_t off = (c->sent > c->hdrlen) ? c->sent - c->hdrlen : 0;
+			iov[n].iov_base = (void*)(c->body + off);
+			iov[n++].iov_len = c->bodylen - off;
+		}
+		struct msghdr msg = {.msg_iov = iov, .msg_iovlen = n};
+		ssize_t s = sendmsg(c->fd, &msg, MSG_NOSIGNAL); // client could close connection
+		if(s < 0){
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			WARN("write()");
+			closeconn(c);
+			return 1;
+		}
+		c->sent += (size_t)s;
+	}
+	// all sent
+	if(c->enc) ++c->delivered;
+	imcache_put(c->enc);
+	c->enc = NULL;
+	FREE(c->text);
+	c->body = NULL;
+	c->bodylen = 0;
+	if(c->stream) waitframe(c); // wait for next frame
+	else if(c->closeafter){
+		closeconn(c);
+		return 1;
+	}else{
+		c->state = CS_READ;
+		setevents(c, EPOLLIN);
+	}
+	if(c->rlen && !c->inproc) processinput(c); // pipelined requests
+	return 1;
+}
+
+// send reply prepared in c->hdr & c->body
+static void startreply(conn *c){
+	c->state = CS_WRITE;
+	c->sent = 0;
+	if(!writereply(c)) setevents(c, EPOLLOUT); // socket buffer is full
+}
+
+// reply to binary client with error
+static void binerror(conn *c){
+	protohdr *h = (protohdr*)c->hdr;
+	memset(h, 0, sizeof(protohdr));
+	h->magic = htole32(PROTO_MAGIC);
+	h->version = PROTO_VERSION;
+	h->cmd = PROTO_ERROR;
+	c->hdrlen = sizeof(protohdr);
+	startreply(c);
+}
+
+// "Connection" header of reply
+static const char *connhdr(conn *c){
+	if(c->closeafter) return "Connection: close\r\n";
+	if(c->http10) return "Connection: keep-alive\r\n";
+	return "";
+}
+
+// reply with HTTP error and close connection
+static void httperror(conn *c, int code, const char *text){
+	c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n"
+		"Connection: close\r\n\r\n", code, text);
+	c->closeafter = 1;
+	startreply(c);
+}
+
+// send encoded image to user
+static void sendimage(conn *c){
+	encimage *e = c->enc;
+	imagetype t = c->imtype;
+	if(!e){ // error: nothing to send
+		if(c->stream) waitframe(c);
+		else if(c->binary) binerror(c);
+		else if(c->webquery) httperror(c, 500, "Internal Server Error");
+		else{
+			c->state = CS_READ;
+			setevents(c, EPOLLIN);
+		}
+		return;
+	}
+	c->body = e->data;
+	c->bodylen = e->len;
+	if(c->binary){
+		protohdr *h = (protohdr*)c->hdr;
+		static const uint16_t formats[] = {0, PROTO_FMT_GRAY8, PROTO_FMT_JPEG, PROTO_FMT_PNG, PROTO_FMT_RICE};
+		memset(h, 0, sizeof(protohdr));
+		h->magic = htole32(PROTO_MAGIC);
+		h->version = PROTO_VERSION;
+		h->cmd = PROTO_FRAME;
+		h->format = htole16(formats[t]);
+		h->width = htole32(c->w);
+		h->height = htole32(c->h);
+		h->frameid = htole64(c->lastframe);
+		h->stamp = htole64((uint64_t)(c->captured * 1e6));
+		h->length = htole32((uint32_t)e->len);
+		h->x = htole16(c->x);
+		h->y = htole16(c->y);
+		c->hdrlen = sizeof(protohdr);
+	}else if(c->stream){ // next part of multipart reply
+		c->hdrlen = 0;
+		if(c->stream == 1){
+			c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 200 OK\r\n"
+				"Content-type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+				"Cache-Control: no-cache\r\nPragma: no-cache\r\nConnection: close\r\n\r\n");
+			c->stream = 2;
+			if(c->head){
+				c->stream = 0;
+				c->closeafter = 1;
+				c->bodylen = 0;
+				startreply(c);
+				return;
+			}
+		}
+		// CRLF before boundary also ends previous part
+		c->hdrlen += snprintf(c->hdr + c->hdrlen, sizeof(c->hdr) - c->hdrlen,
+			"\r\n--" MJPEG_BOUNDARY "\r\nContent-type: image/jpeg\r\nContent-Length: %zd\r\n\r\n",
+			e->len);
+	}else if(!c->webquery){
+		if(t == IMTYPE_RAW)
+			c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "%s\n%dx%d\n", imsuffixes[t], c->w, c->h);
+		else
+			c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "%s\n%zd\n", imsuffixes[t], e->len);
+	}else{
+		c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 200 OK\r\nContent-type: image/%s\r\n"
+			"Content-Length: %zd\r\nX-ROI: %d,%d,%d,%d\r\nX-Encode-Time: %.2fms\r\n%s\r\n",
+			mimetypes[t], e->len, c->x, c->y, c->w, c->h, e->enctime * 1e3, connhdr(c));
+		if(c->head) c->bodylen = 0;
+	}
+	startreply(c);
+}
+
+// send image got from imcache
+static void sendencoded(conn *c){
+	c->enc = c->waiter.enc;
+	if(c->enc){
+		c->w = c->enc->w;
+		c->h = c->enc->h;
+	}
+	sendimage(c);
+}
+
+// get encoded frame from cache or give it to encoding threads
+static void encode(conn *c, imframe *f){
+	enckey key = c->key;
+	key.imtype = c->imtype;
+	unwait(c);
+	c->state = CS_ENCODE;
+	c->captured = f->captured;
+	if(c->lastframe && f->id > c->lastframe + 1) c->dropped += f->id - c->lastframe - 1;
+	c->lastframe = f->id;
+	c->waiter.ready = encready;
+	int ready = imcache_submit(f, &key, &c->waiter);
+	framebuf_put(f);
+	c->x = key.x; // ROI fitted into frame
+	c->y = key.y;
+	if(ready) sendencoded(c);
+}
+
+// send new frames to waiting connections, send the latest one after timeout
+static void servewaiting(){
+	uint64_t lastid = framebuf_lastid();
+	double now = dtime();
+	conn *c = waiting, *nxt;
+	for(; c; c = nxt){
+		nxt = c->next;
+		if(lastid <= c->lastframe && (c->stream || now < c->deadline)) continue;
+		imframe *f = framebuf_get();
+		if(!f){
+			DBG("No frames captured");
+			unwait(c);
+			if(c->webquery) httperror(c, 503, "Service Unavailable");
+			else if(c->binary) binerror(c);
+			else closeconn(c);
+			continue;
+		}
+		encode(c, f);
+	}
+}
+
+// send counters of all clients
+static void sendstats(conn *c){
+	static const char *states[] = {"read", "wait", "encode", "write"};
+	size_t L = (size_t)(nconns + 5) * 128, len = 0;
+	conn *a;
+	imagetype t;
+	bufpool_stat st;
+	c->text = MALLOC(char, L);
+	bufpool_stats(&st); // mallocs and frees shouldn't grow in steady state
+	len += snprintf(c->text + len, L - len, "# buffers: %llu gets, %llu puts, %llu mallocs, %llu frees, "
+		"%llu in use, %llu cached\n", (unsigned long long)st.gets, (unsigned long long)st.puts,
+		(unsigned long long)st.mallocs, (unsigned long long)st.frees, (unsigned long long)st.inuse,
+		(unsigned long long)st.cached);
+	for(t = IMTYPE_JPG; t <= IMTYPE_RICE; ++t){ // encoding time
+		uint64_t n;
+		double total, last;
+		imcache_stats(t, &n, &total, &last);
+		len += snprintf(c->text + len, L - len, "# %s: %llu images, average %.2fms, last %.2fms\n",
+			imsuffixes[t], (unsigned long long)n, n ? total * 1e3 / n : 0., last * 1e3);
+	}
+	len += snprintf(c->text + len, L - len, "# client, request, state, delivered, dropped\n");
+	for(a = allconns; a && len < L; a = a->anext){
+		const char *req = "-";
+		if(a->stream) req = a->binary ? "subscribe" : "mjpg";
+		else if(a->imtype != IMTYPE_NONE) req = mimetypes[a->imtype];
+		len += snprintf(c->text + len, L - len, "%s %s %s %llu %llu\n", a->peer, req,
+			states[a->state], (unsigned long long)a->delivered, (unsigned long long)a->dropped);
+	}
+	if(len >= L) len = L - 1;
+	c->body = (uint8_t*)c->text;
+	c->bodylen = len;
+	if(c->webquery){
+		c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "HTTP/1.1 200 OK\r\nContent-type: text/plain\r\n"
+			"Content-Length: %zd\r\n%s\r\n", len, connhdr(c));
+		if(c->head) c->bodylen = 0;
+	}else
+		c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "stats\n%zd\n", len);
+	startreply(c);
+}
+
+// set sticky ROI (zero w or h - full frame); @return 0 if values are wrong
+static int setroi(conn *c, long x, long y, long w, long h){
+	if(x < 0 || y < 0 || w < 0 || h < 0 || x > UINT16_MAX || y > UINT16_MAX
+		|| w > INT_MAX || h > INT_MAX) return 0;
+	if(!w || !h) x = y = w = h = 0;
+	c->key.x = (int)x;
+	c->key.y = (int)y;
+	c->key.w = (int)w;
+	c->key.h = (int)h;
+	DBG("%s: ROI %ld,%ld,%ldx%ld", c->peer, x, y, w, h);
+	return 1;
+}
+
+// set sticky binning (bin > 1) or downscaling to width (width > 0); @return 0 if values are wrong
+static int setscale(conn *c, long bin, long width, long binsum){
+	if(bin < 0 || width < 0 || bin > INT_MAX || width > INT_MAX) return 0;
+	c->key.bin = (int)bin;
+	c->key.width = (int)width;
+	c->key.binsum = !!binsum;
+	DBG("%s: bin %ld%s, width %ld", c->peer, bin, binsum ? " (sum)" : "", width);
+	return 1;
+}
+
+// set sticky JPEG quality (0 - default) and DCT method; @return 0 if values are wrong
+static int setquality(conn *c, long quality, long dct){
+	if(quality < 0 || quality > 100 || dct < 0 || dct > JPEGENC_DCT_FLOAT) return 0;
+	c->key.quality = (int)quality;
+	c->key.dct = (int)dct;
+	DBG("%s: quality %ld, DCT %s", c->peer, quality, dctnames[dct]);
+	return 1;
+}
+
+// set sticky PNG compression level (0 - default) and filter; @return 0 if values are wrong
+static int setpng(conn *c, long level, long filter){
+	if(level < 0 || level > 9 || filter < 0 || filter > PNGENC_FILTER_AUTO) return 0;
+	c->key.level = (int)level;
+	c->key.filter = (int)filter;
+	DBG("%s: PNG level %ld, filter %s", c->peer, level, filternames[filter]);
+	return 1;
+}
+
+// @return index of name in NULL-terminated names or -1
+static int byname(const char **names, const char *name){
+	int i;
+	for(i = 0; names[i]; ++i)
+		if(strcmp(name, names[i]) == 0) return i;
+	return -1;
+}
+
+// parameters from query string "x=..&y=..&w=..&h=..&bin=..&mode=sum|avg&width=..&q=..&dct=..
+// &level=..&filter=.." (ROI, binning or downscaled width, JPEG quality and DCT method,
+// PNG compression level and filter), omitted values stay the same, unknown are
+// ignored; @return 0 if wrong
+static int webparams(conn *c, char *q){
+	static const char *names[] = {"x", "y", "w", "h", "bin", "width", "q", "level", NULL};
+	long v[8] = {c->key.x, c->key.y, c->key.w, c->key.h, c->key.bin, c->key.width, c->key.quality,
+		c->key.level};
+	int binsum = c->key.binsum, dct = c->key.dct, filter = c->key.filter;
+	char *par, *saveptr;
+	for(par = strtok_r(q, "&", &saveptr); par; par = strtok_r(NULL, "&", &saveptr)){
+		char *val = strchr(par, '='), *ep;
+		int i;
+		if(!val) continue;
+		*val++ = 0;
+		if(strcmp(par, "mode") == 0){
+			if(strcmp(val, "sum") == 0) binsum = 1;
+			else if(strcmp(val, "avg") == 0) binsum = 0;
+			else return 0;
+			continue;
+		}
+		if(strcmp(par, "dct") == 0){
+			if((dct = byname(dctnames, val)) < 0) return 0;
+			continue;
+		}
+		if(strcmp(par, "filter") == 0){
+			if((filter = byname(filternames, val)) < 0) return 0;
+			continue;
+		}
+		for(i = 0; names[i] && strcmp(par, names[i]); ++i);
+		if(!names[i]) continue;
+		v[i] = strtol(val, &ep, 10);
+		if(ep == val || *ep) return 0;
+	}
+	enckey old = c->key; // wrong request shouldn't change anything
+	if(setroi(c, v[0], v[1], v[2], v[3]) && setscale(c, v[4], v[5], binsum) &&
+		setquality(c, v[6], dct) && setpng(c, v[7], filter)) return 1;
+	c->key = old;
+	return 0;
+}
+
+// process query: name of image type, "sum=N", "roi=x,y,w,h", "bin=N[,sum]", "width=N"
+// "q=N[,dct]" or "level=N[,filter]"
+/**
+ * Reply to a parameter query with one text line (wrapped into HTTP reply for web clients)
+ * @param line - reply text or NULL if the query was malformed
+ */
+static void paramreply(conn *c, const char *line){
+	if(!line){
+		if(c->webquery){
+			httperror(c, 400, "Bad Request");
+			return;
+		}
+		line = "error\n";
+	}
+	if(c->webquery){
+		size_t L = strlen(line);
+		c->hdrlen = snprintf(c->hdr, sizeof(c->hdr),
+			"HTTP/1.1 200 OK\r\nContent-type: text/plain\r\nContent-Length: %zd\r\n%s\r\n%s",
+			L, connhdr(c), c->head ? "" : line);
+	}else c->hdrlen = snprintf(c->hdr, sizeof(c->hdr), "%s", line);
+	startreply(c);
+}
+
+static void query(conn *c, const char *found){
+	if(strcmp(found, "stats") == 0){
+		sendstats(c);
+		return;
+	}
+	if(strncmp(found, "roi=", 4) == 0){
+		long x, y, w, h;
+		char tail;
+		char line[64];
+		if(sscanf(found + 4, "%ld,%ld,%ld,%ld%c", &x, &y, &w, &h, &tail) != 4 || !setroi(c, x, y, w, h)){
+			paramreply(c, NULL);
+			return;
+		}
+		snprintf(line, sizeof(line), "roi=%d,%d,%d,%d\n", c->key.x, c->key.y, c->key.w, c->key.h);
+		paramreply(c, line);
+		return;
+	}
+	if(strncmp(found, "bin=", 4) == 0 || strncmp(found, "width=", 6) == 0){
+		const char *val = strchr(found, '=') + 1;
+		char *ep, line[64];
+		long x = strtol(val, &ep, 10);
+		int binsum = (strcmp(ep, ",sum") == 0);
+		if(ep == val || (*ep && !binsum) || !(*found == 'w' ? setscale(c, 0, x, 0) : setscale(c, x, 0, binsum))){
+			paramreply(c, NULL);
+			return;
+		}
+		snprintf(line, sizeof(line), "bin=%d%s width=%d\n",
+			c->key.bin, c->key.binsum ? ",sum" : "", c->key.width);
+		paramreply(c, line);
+		return;
+	}
+	if(strncmp(found, "q=", 2) == 0){
+		char *ep, line[64];
+		long x = strtol(found + 2, &ep, 10);
+		int dct = 0;
+		if(ep == found + 2 || (*ep && (*ep != ',' || (dct = byname(dctnames, ep + 1)) < 0))
+			|| !setquality(c, x, dct)){
+			paramreply(c, NULL);
+			return;
+		}
+		snprintf(line, sizeof(line), "q=%d,%s\n", c->key.quality, dctnames[c->key.dct]);
+		paramreply(c, line);
+		return;
+	}
+	if(strncmp(found, "level=", 6) == 0){
+		char *ep, line[64];
+		long x = strtol(found + 6, &ep, 10);
+		int filter = 0;
+		if(ep == found + 6 || (*ep && (*ep != ',' || (filter = byname(filternames, ep + 1)) < 0))
+			|| !setpng(c, x, filter)){
+			paramreply(c, NULL);
+			return;
+		}
+		snprintf(line, sizeof(line), "level=%d,%s\n", c->key.level, filternames[c->key.filter]);
+		paramreply(c, line);
+		return;
+	}
+	if(strncmp(found, "sum=", 4) == 0){
+		char *ep;
+		long x = strtol(found + 4, &ep, 0);
+		if(ep != found + 4 && (*ep == 0 || !c->webquery) && x > 0 && x < 255)
+			Global_parameters->nsum = (int)x;
+		size_t sumlen = snprintf(c->hdr, sizeof(c->hdr), "sum=%d", Global_parameters->nsum);
+		c->hdrlen = snprintf(c->hdr, sizeof(c->hdr),
+			"HTTP/1.1 200 OK\r\n"
+			"Access-Control-Allow-Origin: *\r\n"
+			"Access-Control-Allow-Methods: GET, POST\r\n"
+			"Access-Control-Allow-Credentials: true\r\n"
+			"Content-type: multipart/form-data\r\nContent-Length: %zd\r\n%s\r\n"
+			"sum=%d", sumlen, connhdr(c), Global_parameters->nsum);
+		DBG("%s", c->hdr);
+		if(!c->webquery) c->closeafter = 1;
+		if(c->head) c->hdrlen -= sumlen;
+		startreply(c);
+		return;
+	}
+	int i = 0;
+	c->imtype = IMTYPE_NONE;
+	do{
+		if(strcasecmp(found, imsuffixes[i]) == 0){
+			c->imtype = suffixtypes[i];
+			if(c->webquery && strcasecmp(found, MJPEG_SUFFIX) == 0) c->stream = 1;
+			break;
+		}
+	}while(imsuffixes[++i]);
+	if(c->imtype == IMTYPE_NONE){
+		if(c->webquery) httperror(c, 404, "Not Found");
+		return;
+	}
+	// OK, now we now what user want: wait for buffer update
+	waitframe(c);
+}
+
+// web query have format GET /anyname.suffix, where suffix defines file type
+static void webquery(conn *c, httpreq *req){
+	char *found, *q;
+	c->webquery = 1;
+	c->binary = 0;
+	c->head = (req->method == HTTP_HEAD);
+	c->closeafter = !req->keepalive;
+	c->http10 = (req->minor == 0);
+	if((q = strchr(req->target, '?')) && !strstr(req->target, "sum=")){
+		*q++ = 0;
+		if(!webparams(c, q)){
+			httperror(c, 400, "Bad Request");
+			return;
+		}
+	}
+	if(strcmp(req->target, "/stats") == 0) found = req->target + 1;
+	else if(strcmp(req->target, "/roi") == 0){ // ROI image without suffix: JPEG
+		query(c, "jpg");
+		return;
+	}else if(!(found = strstr(req->target, "sum="))){
+		if(*req->target != '/' || !(found = strrchr(req->target, '.')) || !(found[1])){
+			httperror(c, 404, "Not Found");
+			return;
+		}
+		++found;
+	}
+	query(c, found);
+}
+
+// binary request
+static void binquery(conn *c, protohdr *req){
+	static const imagetype types[] = {IMTYPE_NONE, IMTYPE_RAW, IMTYPE_JPG, IMTYPE_PNG, IMTYPE_RICE};
+	if(le32toh(req->magic) != PROTO_MAGIC){ // lost synchronisation
+		closeconn(c);
+		return;
+	}
+	DBG("binary command %d, format %d", req->cmd, le16toh(req->format));
+	c->binary = 1;
+	c->webquery = 0;
+	// ROI could be moved without stopping of pushing frames
+	if(req->cmd == PROTO_ROI && req->version == PROTO_VERSION && setroi(c, le16toh(req->x),
+		le16toh(req->y), le32toh(req->width), le32toh(req->height))) return;
+	if(req->cmd == PROTO_SCALE && req->version == PROTO_VERSION &&
+		setscale(c, le16toh(req->x), le32toh(req->width), le16toh(req->y))) return;
+	if(req->cmd == PROTO_QUALITY && req->version == PROTO_VERSION){
+		enckey old = c->key; // both parameter pairs should be valid
+		if(setquality(c, le16toh(req->x), le16toh(req->y)) &&
+			setpng(c, le32toh(req->width), le32toh(req->height))) return;
+		c->key = old;
+	}
+	// any command stops pushing frames
+	unwait(c);
+	c->state = CS_READ;
+	c->stream = 0;
+	if(req->version != PROTO_VERSION){
+		c->closeafter = 1;
+		binerror(c);
+		return;
+	}
+	uint16_t fmt = le16toh(req->format);
+	switch(req->cmd){
+		case PROTO_STOP:
+			setevents(c, EPOLLIN);
+			return;
+		case PROTO_GET:
+		case PROTO_SUBSCRIBE:
+			if(fmt > PROTO_FMT_RICE || !fmt) break;
+			c->imtype = types[fmt];
+			if(req->cmd == PROTO_SUBSCRIBE) c->stream = 2;
+			waitframe(c);
+			return;
+		default:
+		break;
+	}
+	binerror(c);
+}
+
+// process all complete requests in input buffer
+static void processinput(conn *c){
+	httpreq req;
+	c->inproc = 1;
+	while(!c->closing && c->rlen && (c->state == CS_READ ||
+		(c->state == CS_WAIT && c->binary && c->stream))){ // subscriber's commands
+		if((uint8_t)c->rbuf[0] == (PROTO_MAGIC & 0xff)){
+			protohdr bin;
+			if(c->rlen < sizeof(protohdr)) break; // wait for the rest
+			memcpy(&bin, c->rbuf, sizeof(protohdr));
+			c->rlen -= sizeof(protohdr);
+			memmove(c->rbuf, c->rbuf + sizeof(protohdr), c->rlen);
+			binquery(c, &bin);
+			continue;
+		}else if(c->state != CS_READ){
+			closeconn(c);
+			break;
+		}
+		req.method = HTTP_NONE; // stays so until the whole header is received
+		int r = http_parse(c->rbuf, c->rlen, &c->scanned, &req);
+		if(r == HTTP_INCOMPLETE){
+			if(c->rlen < sizeof(c->rbuf)) break;
+			if(req.method == HTTP_NONE) httperror(c, 431, "Request Header Fields Too Large");
+			else httperror(c, 413, "Payload Too Large"); // header is OK but body doesn't fit
+			break;
+		}
+		if(r == HTTP_TOOLARGE){
+			httperror(c, 413, "Payload Too Large");
+			break;
+		}
+		if(r == HTTP_BADREQ){
+			httperror(c, 400, "Bad Request");
+			break;
+		}
+		c->scanned = 0;
+		if(r == HTTP_NOTHTTP){ // regular query: all data read
+			char buff[NET_RBUFLEN+1];
+			size_t l = c->rlen;
+			memcpy(buff, c->rbuf, l);
+			while(l && (buff[l-1] == '\n' || buff[l-1] == '\r' || buff[l-1] == ' ' || buff[l-1] == '\t')) --l;
+			buff[l] = 0;
+			c->rlen = 0;
+			DBG("Buff: %s", buff);
+			c->webquery = 0;
+			c->binary = 0;
+			query(c, buff);
+			continue;
+		}
+		DBG("%.*s", r, c->rbuf);
+		webquery(c, &req);
+		// remove request from buffer; pipelined requests will be processed after reply
+		c->rlen -= (size_t)r;
+		memmove(c->rbuf, c->rbuf + r, c->rlen);
+	}
+	c->inproc = 0;
+	if(c->closing && c->state != CS_ENCODE) dropconn(c);
+}
+
+static void readrequest(conn *c){
+	ssize_t readed = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+	if(readed < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+	if(readed <= 0){ // error or disconnect
+		DBG("Nothing to read from fd %d (ret: %zd)", c->fd, readed);
+		closeconn(c);
+		return;
+	}
+	c->rlen += (size_t)readed;
+	processinput(c);
+}
+
+static void connevent(conn *c, uint32_t events){
+	if(c->closing) return; // closed by previous event
+	if(events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)){
+		closeconn(c);
+		return;
+	}
+	switch(c->state){
+		case CS_READ:
+		case CS_WAIT: // only subscribers listen for input while waiting
+			if(events & EPOLLIN) readrequest(c);
+		break;
+		case CS_WRITE:
+			if(events & EPOLLOUT) writereply(c);
+		break;
+		default:
+		break;
+	}
+}
+
+static void acceptall(int sock){
+	while(1){
+		struct sockaddr_in sa = {0};
+		socklen_t salen = sizeof(sa);
+		int fd = accept4(sock, (struct sockaddr*)&sa, &salen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) WARN("accept()");
+			return;
+		}
+		conn *c = MALLOC(conn, 1);
+		c->fd = fd;
+		c->state = CS_READ;
+		if(sa.sin_family == AF_INET){
+			char ip[INET_ADDRSTRLEN];
+			inet_ntop(AF_INET, &sa.sin_addr, ip, sizeof(ip));
+			snprintf(c->peer, sizeof(c->peer), "%s:%d", ip, ntohs(sa.sin_port));
+		}else snprintf(c->peer, sizeof(c->peer), "fd%d", fd);
+		int lowat = NET_NOTSENT_LOWAT;
+		if(setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)))
+			DBG("setsockopt(TCP_NOTSENT_LOWAT) failed");
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)){
+			WARN("epoll_ctl()");
+			close(fd);
+			FREE(c);
+			continue;
+		}
+		if((c->anext = allconns)) allconns->aprev = c;
+		allconns = c;
+		++nconns;
+	}
+}
+
+// process connections with encoded images
+static void encoded(){
+	conn *c, *list;
+	pthread_mutex_lock(&done_mutex);
+	list = done;
+	done = NULL;
+	pthread_mutex_unlock(&done_mutex);
+	while((c = list)){
+		list = c->qnext;
+		if(c->closing){
+			c->enc = c->waiter.enc;
+			dropconn(c);
+		}else sendencoded(c);
+	}
+}
+
+static void addfd(int fd, void *token){
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = token};
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) ERR("epoll_ctl()");
+}
+
+/**
+ * Serve clients until running() returns 0
+ * @param sock    - listening socket
+ * @param running - function checking whether to continue
+ * @return 0 if failure
+ */
+int net_run(int sock, int (*running)()){
+	struct epoll_event evs[NET_MAXEVENTS];
+	eventfd_t val;
+	int shmsock = -1;
+	if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK)) WARN("fcntl()");
+	if((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+		(framefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+		(donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+		WARN("epoll/eventfd");
+		return 0;
+	}
+	addfd(sock, &tok_listen);
+	addfd(framefd, &tok_frame);
+	addfd(donefd, &tok_done);
+	if(Global_parameters->shmpath && (shmsock = shmring_listen(Global_parameters->shmpath)) > -1)
+		addfd(shmsock, &tok_shm);
+	framebuf_subscribe(framefd);
+	/// "Не могу создать потоки кодирования"
+	if(!encpool_start(Global_parameters->nworkers)) ERRX(_("Can't create encoding threads"));
+	DBG("binning kernels: %s", binning_isa());
+	while(running()){
+		int i, n = epoll_wait(epfd, evs, NET_MAXEVENTS, 100);
+		if(n < 0){
+			if(errno == EINTR) continue;
+			WARN("epoll_wait()");
+			break;
+		}
+		for(i = 0; i < n; ++i){
+			void *p = evs[i].data.ptr;
+			if(p == &tok_listen) acceptall(sock);
+			else if(p == &tok_shm) shmring_handshake(shmsock);
+			else if(p == &tok_frame) eventfd_read(framefd, &val);
+			else if(p == &tok_done){
+				eventfd_read(donefd, &val);
+				encoded();
+			}else connevent((conn*)p, evs[i].events);
+		}
+		servewaiting();
+		freeclosed();
+	}
+	framebuf_unsubscribe(framefd);
+	encpool_stop(); // all submitted images are encoded here
+	encoded();
+	freeclosed();
+	close(framefd);
+	close(donefd);
+	if(shmsock > -1){
+		close(shmsock);
+		shmring_close();
+	}
+	close(epfd);
+	return 1;
+}
@@ -0,0 +1,48 @@
+/*
+ * net.h - event loop serving clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __NET_H__
+#define __NET_H__
+
+// max time (ms) to wait for a new frame, after that the latest one is sent
+#ifndef FRAME_TIMEOUT
+	#define FRAME_TIMEOUT			(2000)
+#endif
+
+// max amount of events got by one epoll_wait
+#ifndef NET_MAXEVENTS
+	#define NET_MAXEVENTS			(64)
+#endif
+
+// size of connection's input buffer (max length of HTTP request header)
+#ifndef NET_RBUFLEN
+	#define NET_RBUFLEN				(2048)
+#endif
+
+// max amount of unsent data in socket buffer
+#ifndef NET_NOTSENT_LOWAT
+	#define NET_NOTSENT_LOWAT		(65536)
+#endif
+
+int net_run(int sock, int (*running)());
+
+#endif // __NET_H__
@@ -0,0 +1,193 @@
+/*
+ * pipeline.c - capture and processing stages on separate threads
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Capture thread (the caller of pipeline_push) reads frames from device and
+ * converts them into GRAY8; it copies each frame into a free slot of framebuf
+ * and gives it to processing thread through a bounded single-producer/
+ * single-consumer queue. Processing thread stacks frames and publishes slots.
+ * Capture thread never waits for processing: when the queue is full the frame
+ * is dropped, so the device buffers are always drained in time.
+ * Frame decoding and conversion stay in capture thread because the decoded
+ * picture (or the driver's buffer) is valid only until the next reading.
+ */
+
+#define _GNU_SOURCE
+#include <sched.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+
+#include "main.h"
+#include "framebuf.h"
+#include "imcache.h"
+#include "stack.h"
+#include "pipeline.h"
+#include "shmring.h"
+
+#define ATOMIC_LOAD(x)      __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+// single-producer/single-consumer queue of filled slots
+static struct{
+	imframe *items[PIPELINE_QLEN];
+	uint32_t head;      // next item to pop (changed by consumer only)
+	uint32_t tail;      // next item to push (changed by producer only), futex word
+	int waiting;        // consumer sleeps on tail
+} queue;
+
+static pthread_t proc_thread;
+static int proc_running = 0;
+static volatile int proc_quit = 0;
+
+// put f into queue, @return 0 if queue is full
+static int queue_push(imframe *f){
+	uint32_t t = queue.tail;
+	if(t - ATOMIC_LOAD(queue.head) == PIPELINE_QLEN) return 0;
+	queue.items[t % PIPELINE_QLEN] = f;
+	__atomic_store_n(&queue.tail, t + 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&queue.waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &queue.tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	return 1;
+}
+
+// get next item from queue, wait for it not more than 100ms; @return NULL if none
+static imframe *queue_pop(){
+	const struct timespec tmout = {0, 100000000L};
+	uint32_t h = queue.head, t = ATOMIC_LOAD(queue.tail);
+	if(t == h){
+		__atomic_store_n(&queue.waiting, 1, __ATOMIC_SEQ_CST);
+		if((t = __atomic_load_n(&queue.tail, __ATOMIC_SEQ_CST)) == h)
+			syscall(SYS_futex, &queue.tail, FUTEX_WAIT_PRIVATE, h, &tmout, NULL, 0);
+		__atomic_store_n(&queue.waiting, 0, __ATOMIC_SEQ_CST);
+		if((t = ATOMIC_LOAD(queue.tail)) == h) return NULL;
+	}
+	imframe *f = queue.items[h % PIPELINE_QLEN];
+	ATOMIC_STORE(queue.head, h + 1);
+	return f;
+}
+
+/**
+ * Get CPU number for n'th stage from Global_parameters->affinity ("cpu0,cpu1")
+ * @return CPU number or -1 if not set
+ */
+static int stage_cpu(int n){
+	char *s = Global_parameters->affinity, *e;
+	if(!s) return -1;
+	while(n--){
+		if(!(s = strchr(s, ','))) return -1;
+		++s;
+	}
+	long cpu = strtol(s, &e, 0);
+	if(e == s || cpu < 0 || cpu >= CPU_SETSIZE) return -1;
+	return (int)cpu;
+}
+
+static void set_affinity(pthread_t thr, int cpu, const char *name){
+	cpu_set_t set;
+	if(cpu < 0) return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(pthread_setaffinity_np(thr, sizeof(set), &set))
+		/// "Не могу привязать поток %s к процессору %d"
+		WARNX(_("Can't bind %s thread to CPU %d"), name, cpu);
+	else
+		DBG("%s thread works on CPU %d", name, cpu);
+}
+
+// stack frame in slot f; @return data to publish or NULL
+static uint8_t *process(imframe *f){
+	static int W = 0, H = 0;
+	int nsum = Global_parameters->nsum;
+	if(nsum < 2) return f->data;
+	if(f->w != W || f->h != H){ // first frame or device changed
+		W = f->w; H = f->h;
+		stack_init(W, H, Global_parameters->stackthreads);
+	}
+	if(Global_parameters->rolling)
+		return stack_roll(f->data, nsum);
+	return stack_push(f->data, nsum);
+}
+
+static void *processing(_U_ void *arg){
+	while(!proc_quit){
+		imframe *f = queue_pop();
+		if(!f) continue;
+		uint8_t *res = process(f);
+		if(!res){ // sum isn't ready yet
+			framebuf_drop(f);
+			continue;
+		}
+		if(res != f->data) memcpy(f->data, res, (size_t)f->w * (size_t)f->h);
+		framebuf_publish(f);
+		// only this thread publishes, so f stays the latest frame until next publication
+		if(Global_parameters->shmpath)
+			shmring_publish(f->data, f->w, f->h, f->id, f->captured);
+		imcache_evict(f->id);
+	}
+	return NULL;
+}
+
+/**
+ * Run processing thread; should be called from capture thread
+ * @return 0 if failure
+ */
+int pipeline_start(){
+	if(proc_running) return 1;
+	proc_quit = 0;
+	if(pthread_create(&proc_thread, NULL, processing, NULL)){
+		WARN("pthread_create()");
+		return 0;
+	}
+	proc_running = 1;
+	set_affinity(pthread_self(), stage_cpu(0), "capture");
+	set_affinity(proc_thread, stage_cpu(1), "processing");
+	return 1;
+}
+
+/**
+ * Give captured frame to processing thread (or drop it if the thread is busy)
+ * @param img  - GRAY8 image
+ * @param w, h - its size
+ */
+void pipeline_push(uint8_t *img, int w, int h){
+	imframe *f = framebuf_claim(w, h);
+	if(!f) return;
+	memcpy(f->data, img, (size_t)w * (size_t)h);
+	f->captured = dtime();
+	if(!queue_push(f)){
+		DBG("Processing is too slow, drop frame");
+		framebuf_drop(f);
+	}
+}
+
+/**
+ * Stop processing thread
+ */
+void pipeline_stop(){
+	imframe *f;
+	if(!proc_running) return;
+	proc_quit = 1;
+	pthread_join(proc_thread, NULL);
+	proc_running = 0;
+	while((f = queue_pop())) framebuf_drop(f);
+	stack_free();
+}
@@ -0,0 +1,342 @@
+/*
+ * pngenc.c - PNG encoder of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * PNG is written without libpng: rows are filtered here and deflated by zlib
+ * right into pool buffer (it grows twice when needed), which is returned as is.
+ *
+ * Large images are cut into blocks of rows deflated in parallel by encpool
+ * threads (as pigz does): each block is raw deflate stream with last 32K of
+ * filtered data before block as dictionary, all blocks except the last one end
+ * with sync flush (empty stored block), so their concatenation is one valid
+ * deflate stream. Adler-32 of blocks are combined. The whole stream is written
+ * in one IDAT chunk.
+ */
+
+#include "main.h"
+#include <zlib.h>
+
+#include "bufpool.h"
+#include "encpool.h"
+#include "pngenc.h"
+
+#define DICTSIZE    (32768)
+// PNG signature, IHDR chunk, IDAT length and type
+#define PNGHEADER   (8 + 25 + 8)
+
+// block of rows deflated by one thread
+typedef struct{
+	const uint8_t *data;
+	int w, h;           // image size
+	int y0, y1;         // rows of block [y0, y1)
+	int level;
+	pngfilter filter;
+	size_t skip;        // reserved bytes at the beginning of output
+	uint8_t *out;       // pool buffer
+	size_t len;         // amount of data in it (including skip), 0 - error
+	uLong adler;        // Adler-32 of filtered rows
+} pngblock;
+
+static inline uint8_t paeth(int a, int b, int c){
+	int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if(pa <= pb && pa <= pc) return (uint8_t)a;
+	if(pb <= pc) return (uint8_t)b;
+	return (uint8_t)c;
+}
+
+// filter row cur (prev - previous one or NULL) by given method into out[w+1]
+static void filterone(uint8_t *out, const uint8_t *cur, const uint8_t *prev, int w, pngfilter f){
+	int i;
+	*out++ = (uint8_t)(f - PNGENC_FILTER_NONE); // PNG filter type
+	switch(f){
+		case PNGENC_FILTER_SUB:
+			out[0] = cur[0];
+			for(i = 1; i < w; ++i) out[i] = cur[i] - cur[i-1];
+		break;
+		case PNGENC_FILTER_UP:
+			if(!prev){
+				memcpy(out, cur, w);
+				break;
+			}
+			for(i = 0; i < w; ++i) out[i] = cur[i] - prev[i];
+		break;
+		case PNGENC_FILTER_AVG:
+			if(!prev){
+				out[0] = cur[0];
+				for(i = 1; i < w; ++i) out[i] = cur[i] - (cur[i-1] >> 1);
+				break;
+			}
+			out[0] = cur[0] - (prev[0] >> 1);
+			for(i = 1; i < w; ++i) out[i] = cur[i] - ((cur[i-1] + prev[i]) >> 1);
+		break;
+		case PNGENC_FILTER_PAETH:
+			if(!prev){ // the same as sub
+				out[0] = cur[0];
+				for(i = 1; i < w; ++i) out[i] = cur[i] - cur[i-1];
+				break;
+			}
+			out[0] = cur[0] - prev[0];
+			for(i = 1; i < w; ++i) out[i] = cur[i] - paeth(cur[i-1], prev[i], prev[i-1]);
+		break;
+		default:
+			memcpy(out, cur, w);
+	}
+}
+
+// sum of filtered bytes as signed values: heuristic of libpng
+static uint64_t rowcost(const uint8_t *row, int w){
+	uint64_t s = 0;
+	int i;
+	for(i = 1; i <= w; ++i) s += (row[i] < 128) ? row[i] : 256 - row[i];
+	return s;
+}
+
+/**
+ * Filter row y of image
+ * @param out - output (w + 1 bytes)
+ * @param tmp - buffer of w + 1 bytes for PNGENC_FILTER_AUTO
+ */
+static void filterrow(uint8_t *out, uint8_t *tmp, const pngblock *b, int y){
+	const uint8_t *cur = b->data + (size_t)y * b->w, *prev = y ? cur - b->w : NULL;
+	uint64_t best, cost;
+	pngfilter f;
+	if(b->filter != PNGENC_FILTER_AUTO){
+		filterone(out, cur, prev, b->w, b->filter);
+		return;
+	}
+	filterone(out, cur, prev, b->w, PNGENC_FILTER_NONE);
+	best = rowcost(out, b->w);
+	for(f = PNGENC_FILTER_SUB; f <= PNGENC_FILTER_PAETH; ++f){
+		filterone(tmp, cur, prev, b->w, f);
+		if((cost = rowcost(tmp, b->w)) < best){
+			best = cost;
+			memcpy(out, tmp, b->w + 1);
+		}
+	}
+}
+
+// deflate given data, grow output when needed; @return 0 if failed
+static int zwrite(z_stream *z, pngblock *b, uint8_t *in, size_t len, int flush){
+	int ret;
+	z->next_in = in;
+	z->avail_in = (uInt)len;
+	do{
+		if(z->avail_out == 0){
+			size_t used = bufpool_size(b->out), sz; // buffer is full
+			b->out = bufpool_grow(b->out, used, 2 * used);
+			sz = bufpool_size(b->out);
+			z->next_out = b->out + used;
+			z->avail_out = (uInt)(sz - used);
+		}
+		ret = deflate(z, flush);
+		if(ret == Z_STREAM_ERROR) return 0;
+	}while(z->avail_in || z->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+	return 1;
+}
+
+// deflate stream and row buffers of encoding thread, reused for all frames
+typedef struct{
+	z_stream z;
+	int zinit;          // z is initialised
+	int level, strategy; // parameters of z
+	uint8_t *buf;       // filtered row, its temporary copy and dictionary rows
+	size_t bufsize;
+} deflater;
+
+static pthread_key_t defkey;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void freedef(void *arg){
+	deflater *d = arg;
+	if(d->zinit) deflateEnd(&d->z);
+	FREE(d->buf);
+	FREE(d);
+}
+
+static void makekey(){
+	if(pthread_key_create(&defkey, freedef)) ERR("pthread_key_create()");
+}
+
+/**
+ * Get deflater of current thread
+ * @param bufsize         - needed size of buf
+ * @param level, strategy - deflate parameters
+ * @return deflater with reset stream or NULL if zlib failed
+ */
+static deflater *getdef(size_t bufsize, int level, int strategy){
+	deflater *d;
+	pthread_once(&key_once, makekey);
+	if(!(d = pthread_getspecific(defkey))){
+		d = MALLOC(deflater, 1);
+		pthread_setspecific(defkey, d);
+	}
+	if(d->bufsize < bufsize){
+		FREE(d->buf);
+		d->buf = MALLOC(uint8_t, bufsize);
+		d->bufsize = bufsize;
+	}
+	// parameters are changed rarely, so stream is created again instead of deflateParams
+	if(d->zinit){
+		if(d->level == level && d->strategy == strategy && deflateReset(&d->z) == Z_OK) return d;
+		deflateEnd(&d->z);
+		d->zinit = 0;
+	}
+	memset(&d->z, 0, sizeof(z_stream));
+	if(deflateInit2(&d->z, level, Z_DEFLATED, -15, 8, strategy) != Z_OK) return NULL;
+	d->zinit = 1;
+	d->level = level;
+	d->strategy = strategy;
+	return d;
+}
+
+// deflate rows of block (subtask of encpool)
+static void blocktask(void *arg){
+	pngblock *b = arg;
+	deflater *d;
+	z_stream *z;
+	size_t rowlen = (size_t)b->w + 1, sz, dlen;
+	uint8_t *row, *tmp, *dict;
+	int y, ok = 1, d0 = b->y0 - (int)((DICTSIZE + rowlen - 1) / rowlen);
+	if(d0 < 0) d0 = 0;
+	dlen = rowlen * (b->y0 - d0);
+	b->len = 0;
+	b->adler = adler32(0L, Z_NULL, 0);
+	sz = b->skip + rowlen * (b->y1 - b->y0) / 2 + 1024; // guess: 2 times compression
+	b->out = bufpool_get(sz);
+	if(!(d = getdef(2 * rowlen + dlen, b->level,
+		b->filter == PNGENC_FILTER_NONE ? Z_DEFAULT_STRATEGY : Z_FILTERED))) return;
+	z = &d->z;
+	row = d->buf;
+	tmp = row + rowlen;
+	dict = tmp + rowlen;
+	z->next_out = b->out + b->skip;
+	z->avail_out = (uInt)(bufpool_size(b->out) - b->skip);
+	if(dlen){ // dictionary: the end of previous block
+		for(y = d0; y < b->y0; ++y) filterrow(dict + rowlen * (y - d0), tmp, b, y);
+		if(dlen > DICTSIZE) deflateSetDictionary(z, dict + dlen - DICTSIZE, DICTSIZE);
+		else deflateSetDictionary(z, dict, (uInt)dlen);
+	}
+	for(y = b->y0; y < b->y1 && ok; ++y){
+		int flush = Z_NO_FLUSH;
+		if(y == b->y1 - 1) flush = (b->y1 == b->h) ? Z_FINISH : Z_SYNC_FLUSH;
+		filterrow(row, tmp, b, y);
+		b->adler = adler32(b->adler, row, (uInt)rowlen);
+		ok = zwrite(z, b, row, rowlen, flush);
+	}
+	if(ok) b->len = bufpool_size(b->out) - z->avail_out;
+}
+
+// write 32-bit big-endian value
+static inline void put32(uint8_t *p, uint32_t v){
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+// write chunk header and data (already there) CRC; @return pointer after chunk
+static uint8_t *chunk(uint8_t *p, const char *type, size_t len){
+	put32(p, (uint32_t)len);
+	memcpy(p + 4, type, 4);
+	put32(p + 8 + len, (uint32_t)crc32(0L, p + 4, (uInt)(len + 4)));
+	return p + 12 + len;
+}
+
+/**
+ * Encode GRAY8 image into PNG
+ * @param size (o) - size of encoded image
+ * @param w, h     - image size
+ * @param data     - image
+ * @param level    - compression level 1..9 (0 - PNGENC_LEVEL)
+ * @param filter   - row filter
+ * @return pool buffer (release it by bufpool_put) or NULL
+ */
+uint8_t *pngenc(size_t *size, int w, int h, const uint8_t *data, int level, pngfilter filter){
+	pngblock blocks[PNGENC_MAXBLOCKS];
+	uint8_t *out, *p;
+	size_t len, need;
+	uLong adler;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, n, rows, flevel;
+	*size = 0;
+	if(w < 1 || h < 1) return NULL;
+	if(level < 1 || level > 9) level = PNGENC_LEVEL;
+	if(filter <= PNGENC_FILTER_DEFAULT || filter > PNGENC_FILTER_AUTO) filter = PNGENC_FILTER;
+	n = encpool_threads();
+	if(cpus > 0 && n > cpus) n = (int)cpus;
+	if(n > PNGENC_MAXBLOCKS) n = PNGENC_MAXBLOCKS;
+	if((size_t)w * h / PNGENC_BLOCKPIX < (size_t)n) n = (int)((size_t)w * h / PNGENC_BLOCKPIX);
+	if(n < 1) n = 1;
+	rows = (h + n - 1) / n;
+	n = (h + rows - 1) / rows;
+	for(i = 0; i < n; ++i){
+		pngblock *b = &blocks[i];
+		b->data = data;
+		b->w = w;
+		b->h = h;
+		b->y0 = i * rows;
+		b->y1 = (i == n - 1) ? h : (i + 1) * rows;
+		b->level = level;
+		b->filter = filter;
+		b->skip = i ? 0 : PNGHEADER + 2; // the first block is written after headers
+	}
+	encpool_forkjoin(blocktask, blocks, sizeof(pngblock), n);
+	for(i = 0; i < n && blocks[i].len; ++i);
+	if(i < n){
+		WARNX("Can't deflate PNG");
+		for(i = 0; i < n; ++i) bufpool_put(blocks[i].out);
+		return NULL;
+	}
+	// join blocks in the first one
+	out = blocks[0].out;
+	len = blocks[0].len;
+	adler = blocks[0].adler;
+	need = len + 4 + 4 + 12; // Adler-32, CRC of IDAT, IEND
+	for(i = 1; i < n; ++i) need += blocks[i].len;
+	if(bufpool_size(out) < need) out = bufpool_grow(out, len, need);
+	for(i = 1; i < n; ++i){
+		pngblock *b = &blocks[i];
+		memcpy(out + len, b->out, b->len);
+		len += b->len;
+		adler = adler32_combine(adler, b->adler, (z_off_t)((size_t)(b->y1 - b->y0) * (w + 1)));
+		bufpool_put(b->out);
+	}
+	put32(out + len, (uint32_t)adler);
+	len += 4;
+	// headers
+	memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+	p = out + 8 + 8;
+	put32(p, (uint32_t)w);
+	put32(p + 4, (uint32_t)h);
+	p[8] = 8;   // bit depth
+	p[9] = 0;   // grayscale
+	p[10] = p[11] = p[12] = 0; // deflate, adaptive filtering, no interlace
+	p = chunk(out + 8, "IHDR", 13);
+	// zlib header: 32K window, deflate; compression level; check bits
+	flevel = (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+	p[8] = 0x78;
+	p[9] = (uint8_t)(flevel << 6);
+	p[9] += (31 - (0x78 * 256 + p[9]) % 31) % 31;
+	p = chunk(p, "IDAT", len - PNGHEADER);
+	p = chunk(p, "IEND", 0);
+	*size = p - out;
+	return out;
+}
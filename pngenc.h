@@ -0,0 +1,62 @@
+/*
+ * pngenc.h - PNG encoder of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __PNGENC_H__
+#define __PNGENC_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// default compression level (1..9)
+#ifndef PNGENC_LEVEL
+	#define PNGENC_LEVEL			(1)
+#endif
+
+// default filter
+#ifndef PNGENC_FILTER
+	#define PNGENC_FILTER			PNGENC_FILTER_AUTO
+#endif
+
+// max amount of blocks deflated in parallel
+#ifndef PNGENC_MAXBLOCKS
+	#define PNGENC_MAXBLOCKS		(16)
+#endif
+
+// min amount of pixels in block (smaller images are deflated by one thread)
+#ifndef PNGENC_BLOCKPIX
+	#define PNGENC_BLOCKPIX			(262144)
+#endif
+
+// row filters
+typedef enum{
+	PNGENC_FILTER_DEFAULT = 0,  // PNGENC_FILTER
+	PNGENC_FILTER_NONE,
+	PNGENC_FILTER_SUB,
+	PNGENC_FILTER_UP,
+	PNGENC_FILTER_AVG,
+	PNGENC_FILTER_PAETH,
+	PNGENC_FILTER_AUTO          // the best of above for each row (as libpng does)
+} pngfilter;
+
+uint8_t *pngenc(size_t *size, int w, int h, const uint8_t *data, int level, pngfilter filter);
+
+#endif // __PNGENC_H__
@@ -0,0 +1,115 @@
+/*
+ * proto.h - binary protocol of socket clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Requests and replies are the same fixed 40-byte header (all fields are
+ * little-endian), replies are followed by `length` bytes of payload.
+ * Client sends header with cmd = PROTO_GET (one frame) or PROTO_SUBSCRIBE
+ * (server pushes every new frame until PROTO_STOP or disconnection) and
+ * wanted format; other fields of request should be zero.
+ * Server answers with PROTO_FRAME (frame data) or PROTO_ERROR (no payload).
+ * PROTO_ROI sets region of interest (x, y, width, height; zero width - full
+ * frame) for all next frames of this connection; it has no reply and doesn't
+ * stop pushing frames, so subscriber could move ROI after guiding star.
+ * Frames cropped by ROI have its position in x, y fields of reply.
+ * PROTO_SCALE works the same way: binning x*x (y != 0 - sum pixels instead of
+ * averaging) or downscaling to given width; zero values - full resolution.
+ * Both are applied to ROI, width and height of reply are size of result.
+ * PROTO_QUALITY sets JPEG quality (x: 1..100, 0 - default) and DCT method
+ * (y: 0 - default, 1 - accurate integer, 2 - fast integer, 3 - float), PNG
+ * compression level (width: 1..9, 0 - default) and filter (height: 0 - default,
+ * 1 - none, 2 - sub, 3 - up, 4 - average, 5 - Paeth, 6 - the best for each row).
+ * The first byte of magic isn't ASCII, so binary requests can't be mixed up
+ * with text ones ("jpg", "sum=N"...).
+ *
+ * Multicast (--mcast) sends raw frames in datagrams of at most PROTO_DGRAMSIZE
+ * bytes, each one starts with protodgram header. Receiver collects fragments
+ * by offset; gaps in seq mean lost datagrams.
+ */
+
+#pragma once
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include <stdint.h>
+
+#define PROTO_MAGIC         (0x47565489)    // "\x89TVG"
+#define PROTO_VERSION       (1)
+
+// commands
+enum{
+	PROTO_GET = 1,      // request: get one frame
+	PROTO_SUBSCRIBE,    // request: push all new frames
+	PROTO_STOP,         // request: stop pushing
+	PROTO_FRAME,        // reply: frame follows
+	PROTO_ERROR,        // reply: bad request or no frames
+	PROTO_ROI,          // request: set region of interest
+	PROTO_SCALE,        // request: set binning or downscaling
+	PROTO_QUALITY       // request: set JPEG quality and DCT method, PNG level and filter
+};
+
+// formats of payload
+enum{
+	PROTO_FMT_GRAY8 = 1,    // raw 8-bit image width x height
+	PROTO_FMT_JPEG,
+	PROTO_FMT_PNG,
+	PROTO_FMT_RICE          // lossless compressed GRAY8 (see rice.h)
+};
+
+typedef struct{
+	uint32_t magic;     // PROTO_MAGIC
+	uint8_t version;    // PROTO_VERSION
+	uint8_t cmd;        // command
+	uint16_t format;    // format of payload
+	uint32_t width;     // image size
+	uint32_t height;
+	uint64_t frameid;   // number of frame
+	uint64_t stamp;     // time of capture (microseconds since the Epoch)
+	uint32_t length;    // length of payload
+	uint16_t x, y;      // position of ROI (zero for full frame)
+} protohdr;
+
+// multicast datagrams
+#define PROTO_DGRAM_MAGIC   (0x4d565489)    // "\x89TVM"
+// max size of datagram (fits into Ethernet frame)
+#ifndef PROTO_DGRAMSIZE
+	#define PROTO_DGRAMSIZE			(1472)
+#endif
+
+typedef struct{
+	uint32_t magic;     // PROTO_DGRAM_MAGIC
+	uint8_t version;    // PROTO_VERSION
+	uint8_t format;     // PROTO_FMT_GRAY8
+	uint16_t nfrags;    // amount of datagrams in frame
+	uint32_t width;     // image size
+	uint32_t height;
+	uint64_t frameid;   // number of frame
+	uint64_t stamp;     // time of capture (microseconds since the Epoch)
+	uint32_t length;    // length of the whole frame
+	uint32_t offset;    // offset of this fragment in frame
+	uint32_t seq;       // number of datagram (through all frames)
+	uint16_t frag;      // number of datagram in frame
+	uint16_t reserved;
+} protodgram;
+
+#define PROTO_DGRAM_PAYLOAD     (PROTO_DGRAMSIZE - sizeof(protodgram))
+
+#endif // __PROTO_H__
@@ -0,0 +1,312 @@
+/*
+ * replaysrc.c - replay of recorded frames
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Supported files (all are replayed in a loop):
+ *   file.ser       - SER video (mono or Bayer, 8 or 16 bit)
+ *   file.pgm       - single binary PGM image
+ *   name%04d.pgm   - sequence of PGM images (numbers start from 0 or 1)
+ *   file.raw,WxH   - GRAY8 frames of given size one after another
+ * Multi-frame files are mapped into memory, 8-bit frames are given directly.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "main.h"
+#include "capsource.h"
+
+#define SER_HDRSIZE     (178)
+
+typedef enum{
+	RP_NONE = 0,
+	RP_MAPPED,      // frames of fixed size in mapped file
+	RP_PGMSEQ       // sequence of PGM files
+} rptype;
+
+static rptype type = RP_NONE;
+static int W, H;
+static int bpp;             // bytes per pixel (1 or 2)
+static int shift;           // shift of 16-bit data to get 8 bits
+static int bigendian;       // byte order of 16-bit data
+static uint8_t *map = NULL; // mapped file
+static size_t maplen;
+static size_t offset;       // offset of the first frame
+static uint64_t nframes, curframe;
+static char *pattern = NULL; // name pattern of PGM sequence
+static int firstno;          // number of the first file in sequence
+static uint8_t *image = NULL; // converted frame
+
+static uint32_t le32(const uint8_t *p){
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// convert 16-bit pixels into 8-bit
+static uint8_t *to8bit(const uint8_t *src){
+	size_t i, S = (size_t)W * (size_t)H;
+	int hi = bigendian ? 0 : 1;
+	for(i = 0; i < S; ++i, src += 2){
+		unsigned v = (src[hi] << 8) | src[1-hi];
+		v >>= shift;
+		image[i] = (v > 255) ? 255 : (uint8_t)v;
+	}
+	return image;
+}
+
+// set shift for 16-bit data of given max value or bit depth
+static void setdepth(int bits){
+	bpp = (bits > 8) ? 2 : 1;
+	shift = (bits > 8) ? bits - 8 : 0;
+}
+
+// map file into memory; quiet != 0 - don't warn if there's no such file
+static int mapfile(const char *name, int quiet){
+	struct stat st;
+	int fd = open(name, O_RDONLY);
+	if(fd < 0){
+		/// "Не могу открыть"
+		if(!quiet || errno != ENOENT) WARN("%s '%s'", _("Cannot open"), name);
+		return 0;
+	}
+	if(fstat(fd, &st) || st.st_size == 0){
+		WARN("stat()");
+		close(fd);
+		return 0;
+	}
+	maplen = st.st_size;
+	map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		map = NULL;
+		WARN("mmap");
+		return 0;
+	}
+	madvise(map, maplen, MADV_SEQUENTIAL);
+	return 1;
+}
+
+/**
+ * Parse header of binary PGM
+ * @param data - file content
+ * @param len  - its length
+ * @param w, h - image size
+ * @param bits - bit depth
+ * @return offset of image data or 0 if failure
+ */
+static size_t pgmheader(const uint8_t *data, size_t len, int *w, int *h, int *bits){
+	size_t pos = 2;
+	long val[3];
+	int i;
+	if(len < 8 || data[0] != 'P' || data[1] != '5') return 0;
+	for(i = 0; i < 3; ++i){
+		while(pos < len && (data[pos] == ' ' || data[pos] == '\t' || data[pos] == '\r' ||
+			data[pos] == '\n' || data[pos] == '#')){
+			if(data[pos] == '#') while(pos < len && data[pos] != '\n') ++pos;
+			else ++pos;
+		}
+		if(pos >= len || data[pos] < '0' || data[pos] > '9') return 0;
+		for(val[i] = 0; pos < len && data[pos] >= '0' && data[pos] <= '9'; ++pos)
+			val[i] = val[i] * 10 + (data[pos] - '0');
+	}
+	++pos; // single whitespace after maxval
+	if(val[0] < 1 || val[1] < 1 || val[2] < 1 || val[2] > 65535) return 0;
+	*w = (int)val[0]; *h = (int)val[1];
+	for(*bits = 1; (1L << *bits) <= val[2]; ++*bits);
+	if(len < pos + (size_t)val[0] * val[1] * (val[2] > 255 ? 2 : 1)) return 0;
+	return pos;
+}
+
+static int open_ser(){
+	int color = (int)le32(map + 18);
+	if(color >= 100){
+		/// "Цветные SER-файлы не поддерживаются"
+		WARNX(_("Color SER files are not supported"));
+		return 0;
+	}
+	bigendian = !le32(map + 22);
+	W = (int)le32(map + 26);
+	H = (int)le32(map + 30);
+	setdepth((int)le32(map + 34));
+	nframes = le32(map + 38);
+	offset = SER_HDRSIZE;
+	return 1;
+}
+
+// @return 1 if p is a safe pattern: exactly one "%d" (or "%0Nd", "%Nd"), other '%' only as "%%"
+static int goodpattern(const char *p){
+	int nconv = 0;
+	for(; *p; ++p){
+		if(*p != '%') continue;
+		if(*++p == '%') continue;
+		if(*p == '0') ++p;
+		while(*p >= '0' && *p <= '9') ++p;
+		if(*p != 'd' || ++nconv > 1) return 0;
+	}
+	return nconv == 1;
+}
+
+// load n'th file of PGM sequence into image
+static int load_pgm(uint64_t n){
+	char name[4096];
+	int w, h, bits, ret = 0;
+	size_t off;
+	snprintf(name, sizeof(name), pattern, (int)(firstno + n));
+	if(!mapfile(name, 1)) return 0; // end of sequence
+	if(!(off = pgmheader(map, maplen, &w, &h, &bits))){
+		/// "Неверный PGM-файл"
+		WARNX("%s: %s", _("Bad PGM file"), name);
+	}else if(image && (w != W || h != H)){
+		/// "Размер изображения изменился"
+		WARNX("%s: %s", _("Image size changed"), name);
+	}else{
+		W = w; H = h;
+		setdepth(bits);
+		if(!image) image = MALLOC(uint8_t, (size_t)W * (size_t)H);
+		bigendian = 1;
+		if(bpp == 1) memcpy(image, map + off, (size_t)W * (size_t)H);
+		else to8bit(map + off);
+		ret = 1;
+	}
+	munmap(map, maplen);
+	map = NULL;
+	return ret;
+}
+
+/**
+ * Open file for replay
+ * @param arg  - file name (see above)
+ * @param w, h - image size
+ * @return 0 if failure
+ */
+static int replay_open(char *arg, int *w, int *h){
+	char *comma;
+	if(!arg || !*arg){
+		/// "Не задан файл для воспроизведения"
+		WARNX(_("File to replay isn't given"));
+		return 0;
+	}
+	curframe = 0;
+	if(strchr(arg, '%')){ // sequence
+		if(!goodpattern(arg)){
+			/// "Шаблон имени должен содержать одно преобразование %d"
+			WARNX("%s: %s", _("Name pattern should have one %d conversion"), arg);
+			return 0;
+		}
+		pattern = strdup(arg);
+		type = RP_PGMSEQ;
+		for(firstno = 0; firstno < 2; ++firstno)
+			if(load_pgm(0)) break;
+		if(firstno == 2){
+			/// "Не найден первый файл последовательности"
+			WARNX("%s: %s", _("First file of sequence not found"), arg);
+			return 0;
+		}
+		nframes = 0; // unknown
+	}else{
+		int bits = 8, rawW = 0, rawH = 0;
+		char *name = strdup(arg);
+		if((comma = strrchr(name, ','))){
+			*comma++ = 0;
+			if(sscanf(comma, "%dx%d", &rawW, &rawH) != 2) rawW = rawH = 0;
+		}
+		int ok = mapfile(name, 0);
+		FREE(name);
+		if(!ok) return 0;
+		type = RP_MAPPED;
+		if(maplen > SER_HDRSIZE && memcmp(map, "LUCAM-RECORDER", 14) == 0){
+			if(!open_ser()) return 0;
+		}else if((offset = pgmheader(map, maplen, &W, &H, &bits))){
+			setdepth(bits);
+			bigendian = 1;
+			nframes = 1;
+		}else if(rawW > 0 && rawH > 0){
+			W = rawW; H = rawH;
+			setdepth(8);
+			offset = 0;
+			nframes = maplen / ((size_t)W * (size_t)H);
+		}else{
+			/// "Неизвестный формат файла (для raw-файла задайте размер: файл,ШxВ)"
+			WARNX(_("Unknown file format (give size for raw file: file,WxH)"));
+			return 0;
+		}
+		if(W < 1 || H < 1 || nframes < 1 ||
+			offset + nframes * (size_t)W * H * bpp > maplen){
+			/// "Файл слишком короткий"
+			WARNX(_("File is too short"));
+			return 0;
+		}
+		if(bpp == 2) image = MALLOC(uint8_t, (size_t)W * (size_t)H);
+	}
+	DBG("replay %s: %dx%d, %d bytes per pixel, %lu frames", arg, W, H, bpp, (unsigned long)nframes);
+	*w = W; *h = H;
+	return 1;
+}
+
+/**
+ * Get next frame (after the last one goes the first)
+ * @param w, h - image size
+ * @return image
+ */
+static uint8_t *replay_next(int *w, int *h){
+	uint8_t *ret = NULL;
+	capsource_pace(Global_parameters->fps);
+	switch(type){
+		case RP_MAPPED:
+			if(curframe >= nframes) curframe = 0;
+			ret = map + offset + curframe * (size_t)W * H * bpp;
+			if(bpp == 2) ret = to8bit(ret);
+		break;
+		case RP_PGMSEQ:
+			if(!load_pgm(curframe)){
+				if(!curframe) break;
+				curframe = 0; // end of sequence
+				if(!load_pgm(curframe)) break;
+			}
+			ret = image;
+		break;
+		default:
+			return NULL;
+	}
+	if(!ret){
+		videodev_prepared = 0;
+		return NULL;
+	}
+	++curframe;
+	*w = W; *h = H;
+	return ret;
+}
+
+static void replay_close(){
+	if(map) munmap(map, maplen);
+	map = NULL;
+	FREE(image);
+	FREE(pattern);
+	type = RP_NONE;
+}
+
+const capsource replay_source = {
+	.name   = "replay",
+	.open   = replay_open,
+	.next   = replay_next,
+	.close  = replay_close,
+	.device = 0
+};
@@ -0,0 +1,230 @@
+/*
+ * rice.c - lossless predictive Rice codec of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rice.h"
+
+// k of block written as is
+#define KRAW    (7)
+
+typedef struct{
+	uint8_t *p;         // next output byte
+	uint64_t acc;       // bits not written yet
+	int n;              // their amount
+} bitwriter;
+
+typedef struct{
+	const uint8_t *p, *end;
+	uint64_t acc;
+	int n;
+} bitreader;
+
+// put n (<= 32) bits, they are written by 32
+static inline void putbits(bitwriter *w, uint32_t bits, int n){
+	w->acc = (w->acc << n) | bits;
+	w->n += n;
+	if(w->n >= 32){
+		uint32_t v = (uint32_t)(w->acc >> (w->n - 32));
+		w->n -= 32;
+		w->p[0] = (uint8_t)(v >> 24);
+		w->p[1] = (uint8_t)(v >> 16);
+		w->p[2] = (uint8_t)(v >> 8);
+		w->p[3] = (uint8_t)v;
+		w->p += 4;
+	}
+}
+
+// @return n (<= 24) bits or -1 if stream is over
+static inline int getbits(bitreader *r, int n){
+	while(r->n < n){
+		if(r->p == r->end) return -1;
+		r->acc = (r->acc << 8) | *r->p++;
+		r->n += 8;
+	}
+	r->n -= n;
+	return (int)((r->acc >> r->n) & ((1u << n) - 1));
+}
+
+// @return amount of zeros before the next one (and skip them and one) or -1
+static inline int getunary(bitreader *r){
+	int q = 0;
+	while(1){
+		uint64_t bits;
+		while(r->n <= 48 && r->p != r->end){
+			r->acc = (r->acc << 8) | *r->p++;
+			r->n += 8;
+		}
+		if(!r->n) return -1;
+		bits = r->acc & ((1ull << r->n) - 1); // unread bits
+		if(bits){
+			int zeros = r->n - (64 - __builtin_clzll(bits));
+			r->n -= zeros + 1;
+			return q + zeros;
+		}
+		q += r->n;
+		r->n = 0;
+		if(q > 255) return -1;
+	}
+}
+
+// predictor of pixel x in row (up - previous row or NULL)
+static inline int predict(const uint8_t *row, const uint8_t *up, int x){
+	int a, b, c;
+	if(!up) return x ? row[x-1] : 0;
+	if(!x) return up[0];
+	a = row[x-1]; b = up[x]; c = up[x-1];
+	if(c >= (a > b ? a : b)) return a < b ? a : b;
+	if(c <= (a < b ? a : b)) return a > b ? a : b;
+	return a + b - c;
+}
+
+// mapped residuals of len pixels of row from x0 (up - previous row or NULL)
+static void residuals(uint8_t *v, const uint8_t *row, const uint8_t *up, int x0, int len){
+	int x;
+	for(x = x0; x < x0 + len; ++x){
+		uint8_t r = (uint8_t)(row[x] - predict(row, up, x)), n = (uint8_t)~r;
+		v[x - x0] = (r & 0x80) ? (uint8_t)((n << 1) | 1) : (uint8_t)(r << 1); // 0, -1, 1, -2...
+	}
+}
+
+static inline void put32le(uint8_t *p, uint32_t v){
+	p[0] = (uint8_t)v; p[1] = (uint8_t)(v >> 8); p[2] = (uint8_t)(v >> 16); p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t get32le(const uint8_t *p){
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/**
+ * @return max size of encoded w x h image
+ */
+size_t rice_bound(int w, int h){
+	size_t nblocks = (size_t)h * (size_t)((w + RICE_BLOCK - 1) / RICE_BLOCK);
+	return RICE_HDRSIZE + (size_t)w * (size_t)h + (nblocks * 3 + 7) / 8 + 8;
+}
+
+/**
+ * Encode image
+ * @param out  - output buffer of rice_bound(w, h) size
+ * @param w, h - image size
+ * @param data - image
+ * @return size of encoded image
+ */
+size_t rice_encode(uint8_t *out, int w, int h, const uint8_t *data){
+	bitwriter bw = {.p = out + RICE_HDRSIZE};
+	uint8_t v[RICE_BLOCK]; // residuals of block
+	int x, y, i, k;
+	memcpy(out, RICE_MAGIC, 4);
+	put32le(out + 4, (uint32_t)w);
+	put32le(out + 8, (uint32_t)h);
+	for(y = 0; y < h; ++y){
+		const uint8_t *row = data + (size_t)y * w;
+		for(x = 0; x < w; x += RICE_BLOCK){
+			int n = (w - x < RICE_BLOCK) ? w - x : RICE_BLOCK, best;
+			uint32_t sum = 0, cost;
+			residuals(v, row, y ? row - w : NULL, x, n);
+			for(i = 0; i < n; ++i) sum += v[i];
+			// k ~ log2(mean value) is near the best one (as in FITS Rice compression)
+			for(k = 0; k < KRAW - 1 && ((uint32_t)n << (k + 1)) <= sum; ++k);
+			cost = (uint32_t)n * (k + 1);
+			for(i = 0; i < n; ++i) cost += v[i] >> k;
+			best = (cost < 8 * (uint32_t)n) ? k : KRAW;
+			putbits(&bw, (uint32_t)best, 3);
+			for(i = 0; i < n; ++i){
+				if(best == KRAW){
+					putbits(&bw, v[i], 8);
+					continue;
+				}
+				uint32_t q = v[i] >> best;
+				while(q > 24){
+					putbits(&bw, 0, 24);
+					q -= 24;
+				}
+				// q zeros, one, k low bits: not more than 31 bits
+				putbits(&bw, (1u << best) | (v[i] & ((1u << best) - 1)), (int)q + 1 + best);
+			}
+		}
+	}
+	// flush: pad with zeros to byte boundary
+	bw.acc <<= (8 - bw.n % 8) % 8;
+	bw.n += (8 - bw.n % 8) % 8;
+	while(bw.n){
+		bw.n -= 8;
+		*bw.p++ = (uint8_t)(bw.acc >> bw.n);
+	}
+	return (size_t)(bw.p - out);
+}
+
+/**
+ * Check stream header
+ * @param in, len - encoded image
+ * @param w, h (o) - image size
+ * @return 0 if it isn't Rice-coded image
+ */
+int rice_info(const uint8_t *in, size_t len, int *w, int *h){
+	uint32_t W, H;
+	if(len < RICE_HDRSIZE || memcmp(in, RICE_MAGIC, 4)) return 0;
+	W = get32le(in + 4);
+	H = get32le(in + 8);
+	if(!W || !H || W > INT32_MAX || H > INT32_MAX) return 0;
+	if(w) *w = (int)W;
+	if(h) *h = (int)H;
+	return 1;
+}
+
+/**
+ * Decode image
+ * @param out     - output buffer (w * h bytes, see rice_info)
+ * @param in, len - encoded image
+ * @return 0 if stream is broken
+ */
+int rice_decode(uint8_t *out, const uint8_t *in, size_t len){
+	bitreader br;
+	int w, h, x, y, i, k, b;
+	if(!rice_info(in, len, &w, &h)) return 0;
+	br = (bitreader){.p = in + RICE_HDRSIZE, .end = in + len};
+	for(y = 0; y < h; ++y){
+		uint8_t *row = out + (size_t)y * w, *up = y ? row - w : NULL;
+		for(x = 0; x < w; x += RICE_BLOCK){
+			int n = (w - x < RICE_BLOCK) ? w - x : RICE_BLOCK;
+			if((k = getbits(&br, 3)) < 0) return 0;
+			for(i = 0; i < n; ++i){
+				int v;
+				if(k == KRAW){
+					if((v = getbits(&br, 8)) < 0) return 0;
+				}else{
+					int q = getunary(&br);
+					if(q < 0 || q > 255) return 0;
+					v = q << k;
+					if(k){
+						if((b = getbits(&br, k)) < 0) return 0;
+						v |= b;
+					}
+					if(v > 255) return 0;
+				}
+				row[x+i] = (uint8_t)(predict(row, up, x + i) + ((v >> 1) ^ -(v & 1)));
+			}
+		}
+	}
+	return 1;
+}
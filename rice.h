@@ -0,0 +1,63 @@
+/*
+ * rice.h - lossless predictive Rice codec of GRAY8 images
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Used by server and clients, depends only on libc.
+ *
+ * Stream: magic RICE_MAGIC, width and height (little-endian 32-bit), then
+ * bit stream (MSB first). Each pixel is predicted by its neighbours (left a,
+ * upper b, upper-left c) as in LOCO-I: min(a,b) if c >= max(a,b), max(a,b) if
+ * c <= min(a,b), a+b-c otherwise (the first row - by a, the first column - by b).
+ * Residuals modulo 256 are mapped to 0..255 (0, -1, 1, -2, 2...) and coded by
+ * blocks of RICE_BLOCK pixels of a row: 3-bit k and Rice codes of block (v>>k
+ * zeros, one, k low bits of v); k == 7 means 8 bits of each value as is.
+ * Dark sky background gives small residuals: 2..4 bits per pixel.
+ *
+ * Example of decoding:
+ *	int w, h;
+ *	if(rice_info(buf, len, &w, &h)){
+ *		uint8_t *img = malloc((size_t)w * h);
+ *		if(!rice_decode(img, buf, len)) ... broken stream ...
+ *	}
+ */
+
+#pragma once
+#ifndef __RICE_H__
+#define __RICE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RICE_MAGIC      "RCE1"
+// size of stream header
+#define RICE_HDRSIZE    (12)
+
+// amount of pixels in block having the same k
+#ifndef RICE_BLOCK
+	#define RICE_BLOCK		(32)
+#endif
+
+size_t rice_bound(int w, int h);
+size_t rice_encode(uint8_t *out, int w, int h, const uint8_t *data);
+int rice_info(const uint8_t *in, size_t len, int *w, int *h);
+int rice_decode(uint8_t *out, const uint8_t *in, size_t len);
+
+#endif // __RICE_H__
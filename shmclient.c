@@ -0,0 +1,169 @@
+/*
+ * shmclient.c - client of frames ring in shared memory
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmclient.h"
+
+#define ATOMIC_LOAD(x)      __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+
+// get memfd from server and map it; @return 0 if failure
+static int attach(shmclient *c){
+	struct sockaddr_un addr;
+	shmhello hello;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+	struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+	struct cmsghdr *cm;
+	int sock, fd = -1;
+	if(strlen(c->path) >= sizeof(addr.sun_path)) return 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, c->path);
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) return 0;
+	if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+		recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello)){
+		close(sock);
+		return 0;
+	}
+	close(sock);
+	if((cm = CMSG_FIRSTHDR(&msg)) && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	if(fd < 0) return 0;
+	if(hello.magic != SHMRING_MAGIC || hello.version != SHMRING_VERSION){
+		close(fd);
+		return 0;
+	}
+	void *map = mmap(NULL, hello.size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // mapping holds memory
+	if(map == MAP_FAILED) return 0;
+	if(c->hdr) munmap(c->hdr, c->size);
+	c->hdr = map;
+	c->size = hello.size;
+	return 1;
+}
+
+// reconnect if server replaced the ring; @return 0 if failure
+static int actual(shmclient *c){
+	if(!ATOMIC_LOAD(c->hdr->obsolete)) return 1;
+	return attach(c);
+}
+
+/**
+ * Connect to server and map its ring
+ * @param path - Unix socket of server (its --shm option)
+ * @return client (free it by shmclient_close) or NULL
+ */
+shmclient *shmclient_open(const char *path){
+	shmclient *c = calloc(1, sizeof(shmclient));
+	if(!c) return NULL;
+	c->path = strdup(path);
+	if(!c->path || !attach(c)){
+		free(c->path);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/**
+ * Wait for a frame newer than given
+ * @param lastid  - number of the last frame got (0 for any)
+ * @param timeout - max waiting time (ms)
+ * @return 1 if there's a new frame, 0 if timeout or error
+ */
+int shmclient_wait(shmclient *c, uint64_t lastid, int timeout){
+	struct timespec t0, now, rest;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(1){
+		if(!actual(c)) return 0;
+		shmhdr *h = c->hdr;
+		uint32_t seq = ATOMIC_LOAD(h->pubseq);
+		uint32_t l = ATOMIC_LOAD(h->latest);
+		if(l && !h->obsolete && ATOMIC_LOAD(h->slots[l-1].frameid) > lastid) return 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long ms = timeout - ((now.tv_sec - t0.tv_sec) * 1000L + (now.tv_nsec - t0.tv_nsec) / 1000000L);
+		if(ms <= 0) return 0;
+		rest.tv_sec = ms / 1000;
+		rest.tv_nsec = (ms % 1000) * 1000000L;
+		// returns at once if frame was published after we read pubseq
+		if(syscall(SYS_futex, &h->pubseq, FUTEX_WAIT, seq, &rest, NULL, 0) && errno != EAGAIN
+			&& errno != EINTR && errno != ETIMEDOUT) return 0;
+	}
+}
+
+/**
+ * Get the latest frame without copying
+ * @param f (o) - frame: its data stays in shared memory
+ * @return 0 if there's no frames
+ */
+int shmclient_latest(shmclient *c, shmframe *f){
+	int tries;
+	if(!actual(c)) return 0;
+	shmhdr *h = c->hdr;
+	for(tries = 0; tries < 100; ++tries){
+		uint32_t l = ATOMIC_LOAD(h->latest);
+		if(!l) return 0;
+		shmslot *s = &h->slots[l - 1];
+		uint32_t seq = ATOMIC_LOAD(s->seq);
+		if(seq & 1) continue; // being written: writer has already moved on to the next slot
+		f->w = (int)s->w;
+		f->h = (int)s->h;
+		f->frameid = s->frameid;
+		f->captured = s->captured;
+		f->slot = (int)(l - 1);
+		f->seq = seq;
+		f->data = (const uint8_t*)h + h->dataoff + (size_t)(l - 1) * h->slotsize;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(ATOMIC_LOAD(s->seq) == seq) return 1;
+	}
+	return 0;
+}
+
+/**
+ * Check that frame data wasn't overwritten since shmclient_latest
+ * (call it after using data)
+ * @return 1 if data is valid
+ */
+int shmclient_check(shmclient *c, const shmframe *f){
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return ATOMIC_LOAD(c->hdr->slots[f->slot].seq) == f->seq;
+}
+
+/**
+ * Unmap ring
+ */
+void shmclient_close(shmclient *c){
+	if(!c) return;
+	if(c->hdr) munmap(c->hdr, c->size);
+	free(c->path);
+	free(c);
+}
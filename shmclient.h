@@ -0,0 +1,65 @@
+/*
+ * shmclient.h - client of frames ring in shared memory
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Usage (shmclient.c depends only on libc):
+ *	shmclient *c = shmclient_open("/tmp/tvguide.sock");
+ *	shmframe f = {.frameid = 0};
+ *	while(shmclient_wait(c, f.frameid, 1000)){
+ *		if(!shmclient_latest(c, &f)) continue;
+ *		... use f.data (it's inside shared memory, don't change it;
+ *		    it's valid until the next call of shmclient functions) ...
+ *		if(!shmclient_check(c, &f)) ... frame was overwritten while used ...
+ *	}
+ *	shmclient_close(c);
+ */
+
+#pragma once
+#ifndef __SHMCLIENT_H__
+#define __SHMCLIENT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shmring.h"
+
+typedef struct{
+	char *path;         // socket path (for reconnection)
+	shmhdr *hdr;        // mapped ring
+	size_t size;        // its size
+} shmclient;
+
+typedef struct{
+	const uint8_t *data; // GRAY8 image in shared memory
+	int w, h;           // its size
+	uint64_t frameid;   // number of frame
+	double captured;    // time of capture
+	int slot;           // slot number
+	uint32_t seq;       // its sequence number when frame was got
+} shmframe;
+
+shmclient *shmclient_open(const char *path);
+int shmclient_wait(shmclient *c, uint64_t lastid, int timeout);
+int shmclient_latest(shmclient *c, shmframe *f);
+int shmclient_check(shmclient *c, const shmframe *f);
+void shmclient_close(shmclient *c);
+
+#endif // __SHMCLIENT_H__
@@ -0,0 +1,218 @@
+/*
+ * shmring.c - ring of frames in shared memory for local clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Ring is created when the first frame is published (its size defines size of
+ * slots). If a frame doesn't fit, a new ring is created and the old one is marked
+ * as obsolete: clients keep their mapping until they reconnect.
+ * Clients connect to Unix socket, get read-only memfd with shmhello message and
+ * are disconnected at once; they never write anything, so the server doesn't
+ * care about them at all.
+ */
+
+#define _GNU_SOURCE // memfd_create
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <limits.h>
+
+#include "main.h"
+#include "shmring.h"
+
+#define ATOMIC_STORE(x, v)  __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define ALIGN(x, a)         (((x) + (a) - 1) / (a) * (a))
+
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int memfd = -1;
+static shmhdr *hdr = NULL;
+static char *sockpath = NULL;
+
+// release current ring, shm_mutex should be locked
+static void freering(){
+	if(!hdr) return;
+	ATOMIC_STORE(hdr->obsolete, 1);
+	ATOMIC_STORE(hdr->pubseq, hdr->pubseq + 1);
+	syscall(SYS_futex, &hdr->pubseq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	munmap(hdr, hdr->size);
+	hdr = NULL;
+	close(memfd);
+	memfd = -1;
+}
+
+// create ring for images of `size` bytes, shm_mutex should be locked
+static int newring(size_t size){
+	size_t pagesz = (size_t)sysconf(_SC_PAGESIZE);
+	size_t dataoff = ALIGN(sizeof(shmhdr) + SHMRING_SLOTS * sizeof(shmslot), pagesz);
+	size_t slotsize = ALIGN(size, pagesz);
+	size_t total = dataoff + SHMRING_SLOTS * slotsize;
+	int fd = memfd_create("tvguide-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd < 0){
+		WARN("memfd_create()");
+		return 0;
+	}
+	if(ftruncate(fd, (off_t)total)){
+		WARN("ftruncate()");
+		close(fd);
+		return 0;
+	}
+	// clients couldn't change size of mapping
+	if(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL))
+		DBG("Can't seal memfd");
+	shmhdr *h = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(h == MAP_FAILED){
+		WARN("mmap()");
+		close(fd);
+		return 0;
+	}
+	// clients get read-only descriptor: they couldn't map ring for writing
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	int rofd = open(path, O_RDONLY | O_CLOEXEC);
+	close(fd); // writable mapping is kept
+	if(rofd < 0){
+		WARN("open(%s)", path);
+		munmap(h, total);
+		return 0;
+	}
+	freering();
+	h->magic = SHMRING_MAGIC;
+	h->version = SHMRING_VERSION;
+	h->nslots = SHMRING_SLOTS;
+	h->slotsize = slotsize;
+	h->dataoff = dataoff;
+	h->size = total;
+	hdr = h;
+	memfd = rofd;
+	DBG("shared memory ring: %d slots of %zd bytes", SHMRING_SLOTS, slotsize);
+	return 1;
+}
+
+/**
+ * Open Unix socket for clients of shared memory
+ * @param path - socket file name
+ * @return socket fd or -1
+ */
+int shmring_listen(const char *path){
+	struct sockaddr_un addr;
+	int sock;
+	if(strlen(path) >= sizeof(addr.sun_path)){
+		/// "Слишком длинный путь к сокету"
+		WARNX(_("Socket path is too long"));
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		WARN("socket()");
+		return -1;
+	}
+	unlink(path); // remove socket of previous run
+	if(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(sock, 16)){
+		/// "Не могу открыть сокет"
+		WARN("%s %s", _("Can't open socket"), path);
+		close(sock);
+		return -1;
+	}
+	FREE(sockpath);
+	sockpath = strdup(path);
+	DBG("shared memory socket: %s", path);
+	return sock;
+}
+
+/**
+ * Give memfd to all clients waiting on Unix socket
+ * @param sock - socket got by shmring_listen
+ */
+void shmring_handshake(int sock){
+	while(1){
+		int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0){
+			if(errno == EINTR) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) WARN("accept()");
+			return;
+		}
+		pthread_mutex_lock(&shm_mutex);
+		if(!hdr) newring(1); // no frames yet: ring will be replaced by the first frame
+		if(hdr){
+			shmhello hello = {.magic = SHMRING_MAGIC, .version = SHMRING_VERSION, .size = hdr->size};
+			char cbuf[CMSG_SPACE(sizeof(int))];
+			struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+			struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1,
+				.msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+			struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cm), &memfd, sizeof(int));
+			if(sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) != sizeof(hello)) WARN("sendmsg()");
+		}
+		pthread_mutex_unlock(&shm_mutex);
+		close(fd);
+	}
+}
+
+/**
+ * Put frame into the ring
+ * @param data     - GRAY8 image
+ * @param w, h     - its size
+ * @param frameid  - number of frame
+ * @param captured - time of capture
+ */
+void shmring_publish(const uint8_t *data, int w, int h, uint64_t frameid, double captured){
+	size_t size = (size_t)w * (size_t)h;
+	pthread_mutex_lock(&shm_mutex);
+	if(!hdr || size > hdr->slotsize){
+		if(!newring(size)){
+			pthread_mutex_unlock(&shm_mutex);
+			return;
+		}
+	}
+	uint32_t n = hdr->latest % hdr->nslots; // the next after latest
+	shmslot *s = &hdr->slots[n];
+	ATOMIC_STORE(s->seq, s->seq + 1); // odd: writing
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	memcpy((uint8_t*)hdr + hdr->dataoff + n * hdr->slotsize, data, size);
+	s->w = w;
+	s->h = h;
+	s->frameid = frameid;
+	s->captured = captured;
+	ATOMIC_STORE(s->seq, s->seq + 1); // even: ready
+	ATOMIC_STORE(hdr->latest, n + 1);
+	ATOMIC_STORE(hdr->pubseq, hdr->pubseq + 1);
+	syscall(SYS_futex, &hdr->pubseq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	pthread_mutex_unlock(&shm_mutex);
+}
+
+/**
+ * Destroy ring and remove socket file
+ */
+void shmring_close(){
+	pthread_mutex_lock(&shm_mutex);
+	freering();
+	if(sockpath){
+		unlink(sockpath);
+		FREE(sockpath);
+	}
+	pthread_mutex_unlock(&shm_mutex);
+}
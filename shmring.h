@@ -0,0 +1,79 @@
+/*
+ * shmring.h - ring of frames in shared memory for local clients
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Layout of shared memory (memfd given to clients through Unix socket):
+ * shmhdr, nslots of shmslot, then (from hdr->dataoff) nslots images of
+ * hdr->slotsize bytes each. Slots are filled in turn; slot's seq is odd while
+ * it's being written and changes after each write, so reader should check that
+ * seq is the same before and after using slot data.
+ * Clients use functions from shmclient.h.
+ */
+
+#pragma once
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stdint.h>
+
+#define SHMRING_MAGIC       (0x52534754)    // "TGSR"
+#define SHMRING_VERSION     (1)
+
+// amount of slots in ring
+#ifndef SHMRING_SLOTS
+	#define SHMRING_SLOTS			(4)
+#endif
+
+typedef struct{
+	uint32_t seq;       // even - slot is stable, odd - being written
+	uint32_t w, h;      // image size
+	uint32_t reserved;
+	uint64_t frameid;   // number of frame
+	double captured;    // time of capture (UNIX time, seconds)
+} shmslot;
+
+typedef struct{
+	uint32_t magic;     // SHMRING_MAGIC
+	uint32_t version;   // SHMRING_VERSION
+	uint32_t nslots;    // amount of slots
+	uint32_t pubseq;    // futex word: incremented after each publication
+	uint64_t slotsize;  // max image size
+	uint64_t dataoff;   // offset of the first image
+	uint64_t size;      // size of shared memory
+	uint32_t latest;    // number of slot with the latest frame plus 1 (0 - no frames yet)
+	uint32_t obsolete;  // 1 - ring is replaced by another one: reconnect
+	shmslot slots[];
+} shmhdr;
+
+// message sent with memfd through Unix socket
+typedef struct{
+	uint32_t magic;     // SHMRING_MAGIC
+	uint32_t version;   // SHMRING_VERSION
+	uint64_t size;      // size of shared memory
+} shmhello;
+
+// server side
+int shmring_listen(const char *path);
+void shmring_handshake(int sock);
+void shmring_publish(const uint8_t *data, int w, int h, uint64_t frameid, double captured);
+void shmring_close();
+
+#endif // __SHMRING_H__
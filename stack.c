@@ -0,0 +1,527 @@
+/*
+ * stack.c - summation of subsequent frames
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Frames are added into uint32 storage; the last frame of a sum is added
+ * together with min/max search, then the sum is scaled into 0..255 and the
+ * storage is cleared in the same pass. Scaling uses multiplication by exact
+ * reciprocal instead of division: for n < 2^24 and l = ceil(log2(w))
+ * floor(n / w) == (n * ceil(2^(24+l) / w)) >> (24+l).
+ * In rolling mode last nsum frames are kept in a ring: each new frame is added
+ * to the sum and the oldest one is subtracted (and replaced by the new one) in
+ * a single pass, so every captured frame gives a normalized sum and the cost
+ * doesn't depend on nsum.
+ * Frame is divided into horizontal bands processed by a small thread pool,
+ * kernels (SSE2/AVX2/C) are chosen at runtime.
+ */
+
+#include "main.h"
+#include "stack.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STACK_X86
+#include <immintrin.h>
+#endif
+
+// max amount of summed frames: (255 * 255 * STACK_MAXSUM) should be less than 2^24
+#define STACK_MAXSUM    (255)
+
+// add N pixels of img to sum; if mm != 0 find min & max of result
+typedef void (*accfn)(uint32_t *sum, const uint8_t *img, int N, int mm, uint32_t *min, uint32_t *max);
+// sum += img - old, old = img; find min & max of result
+typedef void (*rollfn)(uint32_t *sum, const uint8_t *img, uint8_t *old, int N, uint32_t *min, uint32_t *max);
+// out = (sum - min) * 255 / w, where m & s are reciprocal of w; clear sum if clr != 0
+typedef void (*normfn)(uint32_t *sum, uint8_t *out, int N, uint32_t min, uint32_t m, int s, int clr);
+
+static void acc_c(uint32_t *sum, const uint8_t *img, int N, int mm, uint32_t *min, uint32_t *max){
+	int x;
+	uint32_t mi = *min, ma = *max;
+	for(x = 0; x < N; ++x){
+		uint32_t v = (sum[x] += img[x]);
+		if(mm){
+			if(v < mi) mi = v;
+			if(v > ma) ma = v;
+		}
+	}
+	*min = mi; *max = ma;
+}
+
+static void roll_c(uint32_t *sum, const uint8_t *img, uint8_t *old, int N, uint32_t *min, uint32_t *max){
+	int x;
+	uint32_t mi = *min, ma = *max;
+	for(x = 0; x < N; ++x){
+		uint32_t v = (sum[x] += img[x] - old[x]);
+		old[x] = img[x];
+		if(v < mi) mi = v;
+		if(v > ma) ma = v;
+	}
+	*min = mi; *max = ma;
+}
+
+static void norm_c(uint32_t *sum, uint8_t *out, int N, uint32_t min, uint32_t m, int s, int clr){
+	int x;
+	for(x = 0; x < N; ++x)
+		out[x] = (uint8_t)(((uint64_t)((sum[x] - min) * 255) * m) >> s);
+	if(clr) memset(sum, 0, sizeof(uint32_t) * N);
+}
+
+#ifdef STACK_X86
+// all sums are less than 2^31, so signed comparison is OK
+__attribute__((target("sse2")))
+static void acc_sse2(uint32_t *sum, const uint8_t *img, int N, int mm, uint32_t *min, uint32_t *max){
+	int x, k;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vmin = _mm_set1_epi32(*min > INT32_MAX ? INT32_MAX : *min), vmax = _mm_set1_epi32(*max);
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)(img + x)), w[4];
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		w[0] = _mm_unpacklo_epi16(lo, zero);
+		w[1] = _mm_unpackhi_epi16(lo, zero);
+		w[2] = _mm_unpacklo_epi16(hi, zero);
+		w[3] = _mm_unpackhi_epi16(hi, zero);
+		for(k = 0; k < 4; ++k){
+			__m128i *p = (__m128i*)(sum + x + 4*k);
+			__m128i r = _mm_add_epi32(_mm_loadu_si128(p), w[k]);
+			_mm_storeu_si128(p, r);
+			if(mm){
+				__m128i c = _mm_cmplt_epi32(r, vmin);
+				vmin = _mm_or_si128(_mm_and_si128(c, r), _mm_andnot_si128(c, vmin));
+				c = _mm_cmpgt_epi32(r, vmax);
+				vmax = _mm_or_si128(_mm_and_si128(c, r), _mm_andnot_si128(c, vmax));
+			}
+		}
+	}
+	if(mm){
+		uint32_t a[4], b[4];
+		_mm_storeu_si128((__m128i*)a, vmin);
+		_mm_storeu_si128((__m128i*)b, vmax);
+		for(k = 0; k < 4; ++k){
+			if(a[k] < *min) *min = a[k];
+			if(b[k] > *max) *max = b[k];
+		}
+	}
+	acc_c(sum + x, img + x, N - x, mm, min, max);
+}
+
+__attribute__((target("sse2")))
+static void roll_sse2(uint32_t *sum, const uint8_t *img, uint8_t *old, int N, uint32_t *min, uint32_t *max){
+	int x, k;
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vmin = _mm_set1_epi32(*min > INT32_MAX ? INT32_MAX : *min), vmax = _mm_set1_epi32(*max);
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i v = _mm_loadu_si128((const __m128i*)(img + x));
+		__m128i o = _mm_loadu_si128((const __m128i*)(old + x));
+		// difference as four vectors of int32
+		__m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpacklo_epi8(o, zero));
+		__m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(v, zero), _mm_unpackhi_epi8(o, zero));
+		__m128i d[4];
+		d[0] = _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16);
+		d[1] = _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16);
+		d[2] = _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16);
+		d[3] = _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16);
+		for(k = 0; k < 4; ++k){
+			__m128i *p = (__m128i*)(sum + x + 4*k);
+			__m128i r = _mm_add_epi32(_mm_loadu_si128(p), d[k]);
+			_mm_storeu_si128(p, r);
+			__m128i c = _mm_cmplt_epi32(r, vmin);
+			vmin = _mm_or_si128(_mm_and_si128(c, r), _mm_andnot_si128(c, vmin));
+			c = _mm_cmpgt_epi32(r, vmax);
+			vmax = _mm_or_si128(_mm_and_si128(c, r), _mm_andnot_si128(c, vmax));
+		}
+		_mm_storeu_si128((__m128i*)(old + x), v);
+	}
+	uint32_t a[4], b[4];
+	_mm_storeu_si128((__m128i*)a, vmin);
+	_mm_storeu_si128((__m128i*)b, vmax);
+	for(k = 0; k < 4; ++k){
+		if(a[k] < *min) *min = a[k];
+		if(b[k] > *max) *max = b[k];
+	}
+	roll_c(sum + x, img + x, old + x, N - x, min, max);
+}
+
+// (n * m) >> s for each 32-bit lane
+__attribute__((target("sse2")))
+static inline __m128i mulshift_sse2(__m128i n, __m128i m, __m128i s){
+	__m128i p02 = _mm_srl_epi64(_mm_mul_epu32(n, m), s);
+	__m128i p13 = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(n, 32), m), s);
+	return _mm_or_si128(p02, _mm_slli_epi64(p13, 32));
+}
+
+__attribute__((target("sse2")))
+static void norm_sse2(uint32_t *sum, uint8_t *out, int N, uint32_t min, uint32_t m, int s, int clr){
+	int x, k;
+	const __m128i zero = _mm_setzero_si128(), vmin = _mm_set1_epi32(min), vm = _mm_set1_epi32(m);
+	const __m128i cnt = _mm_cvtsi32_si128(s);
+	for(x = 0; x <= N - 16; x += 16){
+		__m128i q[4];
+		for(k = 0; k < 4; ++k){
+			__m128i *p = (__m128i*)(sum + x + 4*k);
+			__m128i d = _mm_sub_epi32(_mm_loadu_si128(p), vmin);
+			d = _mm_sub_epi32(_mm_slli_epi32(d, 8), d); // *255
+			q[k] = mulshift_sse2(d, vm, cnt);
+			if(clr) _mm_storeu_si128(p, zero);
+		}
+		_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(
+			_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+	}
+	norm_c(sum + x, out + x, N - x, min, m, s, clr);
+}
+
+__attribute__((target("avx2")))
+static void acc_avx2(uint32_t *sum, const uint8_t *img, int N, int mm, uint32_t *min, uint32_t *max){
+	int x, k;
+	__m256i vmin = _mm256_set1_epi32(*min), vmax = _mm256_set1_epi32(*max);
+	for(x = 0; x <= N - 32; x += 32){
+		for(k = 0; k < 4; ++k){
+			__m256i *p = (__m256i*)(sum + x + 8*k);
+			__m256i v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(img + x + 8*k)));
+			__m256i r = _mm256_add_epi32(_mm256_loadu_si256(p), v);
+			_mm256_storeu_si256(p, r);
+			if(mm){
+				vmin = _mm256_min_epu32(vmin, r);
+				vmax = _mm256_max_epu32(vmax, r);
+			}
+		}
+	}
+	if(mm){
+		uint32_t a[8], b[8];
+		_mm256_storeu_si256((__m256i*)a, vmin);
+		_mm256_storeu_si256((__m256i*)b, vmax);
+		for(k = 0; k < 8; ++k){
+			if(a[k] < *min) *min = a[k];
+			if(b[k] > *max) *max = b[k];
+		}
+	}
+	acc_c(sum + x, img + x, N - x, mm, min, max);
+}
+
+__attribute__((target("avx2")))
+static void roll_avx2(uint32_t *sum, const uint8_t *img, uint8_t *old, int N, uint32_t *min, uint32_t *max){
+	int x, k;
+	__m256i vmin = _mm256_set1_epi32(*min), vmax = _mm256_set1_epi32(*max);
+	for(x = 0; x <= N - 32; x += 32){
+		__m256i v = _mm256_loadu_si256((const __m256i*)(img + x));
+		for(k = 0; k < 4; ++k){
+			__m256i *p = (__m256i*)(sum + x + 8*k);
+			__m256i n = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(img + x + 8*k)));
+			__m256i o = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(old + x + 8*k)));
+			__m256i r = _mm256_sub_epi32(_mm256_add_epi32(_mm256_loadu_si256(p), n), o);
+			_mm256_storeu_si256(p, r);
+			vmin = _mm256_min_epu32(vmin, r);
+			vmax = _mm256_max_epu32(vmax, r);
+		}
+		_mm256_storeu_si256((__m256i*)(old + x), v);
+	}
+	uint32_t a[8], b[8];
+	_mm256_storeu_si256((__m256i*)a, vmin);
+	_mm256_storeu_si256((__m256i*)b, vmax);
+	for(k = 0; k < 8; ++k){
+		if(a[k] < *min) *min = a[k];
+		if(b[k] > *max) *max = b[k];
+	}
+	roll_c(sum + x, img + x, old + x, N - x, min, max);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i mulshift_avx2(__m256i n, __m256i m, __m128i s){
+	__m256i p02 = _mm256_srl_epi64(_mm256_mul_epu32(n, m), s);
+	__m256i p13 = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(n, 32), m), s);
+	return _mm256_or_si256(p02, _mm256_slli_epi64(p13, 32));
+}
+
+// packs work inside 128-bit lanes, so dwords should be reordered after them
+__attribute__((target("avx2")))
+static void norm_avx2(uint32_t *sum, uint8_t *out, int N, uint32_t min, uint32_t m, int s, int clr){
+	int x, k;
+	const __m256i zero = _mm256_setzero_si256(), vmin = _mm256_set1_epi32(min), vm = _mm256_set1_epi32(m);
+	const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	const __m128i cnt = _mm_cvtsi32_si128(s);
+	for(x = 0; x <= N - 32; x += 32){
+		__m256i q[4];
+		for(k = 0; k < 4; ++k){
+			__m256i *p = (__m256i*)(sum + x + 8*k);
+			__m256i d = _mm256_sub_epi32(_mm256_loadu_si256(p), vmin);
+			d = _mm256_sub_epi32(_mm256_slli_epi32(d, 8), d);
+			q[k] = mulshift_avx2(d, vm, cnt);
+			if(clr) _mm256_storeu_si256(p, zero);
+		}
+		__m256i r = _mm256_packus_epi16(_mm256_packus_epi32(q[0], q[1]), _mm256_packus_epi32(q[2], q[3]));
+		_mm256_storeu_si256((__m256i*)(out + x), _mm256_permutevar8x32_epi32(r, order));
+	}
+	norm_c(sum + x, out + x, N - x, min, m, s, clr);
+}
+#endif // STACK_X86
+
+static accfn acc = acc_c;
+static rollfn roll = roll_c;
+static normfn norm = norm_c;
+static const char *isa = "C";
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void init_kernels(){
+#ifdef STACK_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")){
+		acc = acc_avx2;
+		roll = roll_avx2;
+		norm = norm_avx2;
+		isa = "AVX2";
+	}else if(__builtin_cpu_supports("sse2")){
+		acc = acc_sse2;
+		roll = roll_sse2;
+		norm = norm_sse2;
+		isa = "SSE2";
+	}
+#endif
+	DBG("stacking kernels: %s", isa);
+}
+
+/**
+ * @return name of instruction set used by stacking kernels
+ */
+const char *stack_isa(){
+	pthread_once(&init_once, init_kernels);
+	return isa;
+}
+
+/******************************************************************************\
+ *                       Thread pool for frame bands                          *
+\******************************************************************************/
+typedef enum{
+	OP_ADD,     // add image
+	OP_ADDMM,   // add image and find min/max
+	OP_ROLL,    // add image, subtract the oldest one and find min/max
+	OP_NORM     // normalize sum
+} stackop;
+
+typedef struct{
+	int first;          // first pixel of band
+	int N;              // amount of pixels
+	uint32_t min, max;  // extremums for OP_ADDMM
+} band;
+
+static int nbands = 0;
+static band bands[STACK_MAXTHREADS];
+static pthread_t workers[STACK_MAXTHREADS];
+static int nworkers = 0; // amount of running threads (besides caller)
+
+static uint32_t *storage = NULL;
+static uint8_t *output = NULL;
+static int imW = 0, imH = 0;
+static int ncaptured = 0; // amount of frames in storage
+static uint8_t *ring = NULL; // last frames for rolling mode
+static int ringsize = 0, ringpos = 0;
+
+// current job
+static struct{
+	stackop op;
+	const uint8_t *img;
+	uint8_t *old;   // oldest frame in ring
+	uint32_t min, m;
+	int s;
+	int clr;        // clear sum after normalization
+	int gen;        // changes for each new job
+	int nbands;     // amount of bands in this job
+	int pending;    // amount of bands not done yet
+} job;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+static void do_band(int n){
+	band *b = &bands[n];
+	switch(job.op){
+		case OP_ADD:
+		case OP_ADDMM:
+			b->min = UINT32_MAX;
+			b->max = 0;
+			acc(storage + b->first, job.img + b->first, b->N, job.op == OP_ADDMM, &b->min, &b->max);
+		break;
+		case OP_ROLL:
+			b->min = UINT32_MAX;
+			b->max = 0;
+			roll(storage + b->first, job.img + b->first, job.old + b->first, b->N, &b->min, &b->max);
+		break;
+		case OP_NORM:
+			norm(storage + b->first, output + b->first, b->N, job.min, job.m, job.s, job.clr);
+		break;
+	}
+}
+
+static void *worker(void *arg){
+	int n = (int)(intptr_t)arg, gen = 0;
+	while(1){
+		pthread_mutex_lock(&job_mutex);
+		while(job.gen == gen) pthread_cond_wait(&job_start, &job_mutex);
+		gen = job.gen;
+		if(n >= job.nbands){ // frame is smaller than amount of threads
+			pthread_mutex_unlock(&job_mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&job_mutex);
+		do_band(n);
+		pthread_mutex_lock(&job_mutex);
+		if(--job.pending == 0) pthread_cond_signal(&job_done);
+		pthread_mutex_unlock(&job_mutex);
+	}
+	return NULL;
+}
+
+// run current job over all bands, band 0 is processed by caller
+static void run(stackop op){
+	job.op = op;
+	if(nbands < 2){
+		do_band(0);
+		return;
+	}
+	pthread_mutex_lock(&job_mutex);
+	job.nbands = nbands;
+	job.pending = nbands - 1;
+	++job.gen;
+	pthread_cond_broadcast(&job_start);
+	pthread_mutex_unlock(&job_mutex);
+	do_band(0);
+	pthread_mutex_lock(&job_mutex);
+	while(job.pending) pthread_cond_wait(&job_done, &job_mutex);
+	pthread_mutex_unlock(&job_mutex);
+}
+
+/**
+ * Prepare storage for frames summation
+ * @param w, h     - image size
+ * @param nthreads - amount of threads (0 - by number of CPUs)
+ */
+void stack_init(int w, int h, int nthreads){
+	int i;
+	pthread_once(&init_once, init_kernels);
+	if(nthreads < 1) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > STACK_MAXTHREADS) nthreads = STACK_MAXTHREADS;
+	if(nthreads > h) nthreads = h;
+	// threads are created once and live until the end
+	for(; nworkers < nthreads - 1; ++nworkers){
+		if(pthread_create(&workers[nworkers], NULL, worker, (void*)(intptr_t)(nworkers + 1))){
+			WARN("pthread_create()");
+			break;
+		}
+		pthread_detach(workers[nworkers]);
+	}
+	if(nthreads > nworkers + 1) nthreads = nworkers + 1;
+	nbands = nthreads;
+	for(i = 0; i < nbands; ++i){ // bands consist of whole rows
+		int y0 = h * i / nbands, y1 = h * (i + 1) / nbands;
+		bands[i].first = y0 * w;
+		bands[i].N = (y1 - y0) * w;
+	}
+	FREE(storage);
+	FREE(output);
+	FREE(ring);
+	storage = MALLOC(uint32_t, (size_t)w * (size_t)h);
+	output = MALLOC(uint8_t, (size_t)w * (size_t)h);
+	imW = w; imH = h;
+	ncaptured = 0;
+	ringsize = ringpos = 0;
+	DBG("stacking %dx%d in %d band[s], kernels: %s", w, h, nbands, isa);
+}
+
+// normalize sum after OP_ADDMM or OP_ROLL; return NULL for flat image
+static uint8_t *normalize(int clr){
+	int i;
+	uint32_t min = bands[0].min, max = bands[0].max;
+	for(i = 1; i < nbands; ++i){
+		if(bands[i].min < min) min = bands[i].min;
+		if(bands[i].max > max) max = bands[i].max;
+	}
+	uint32_t w = max - min;
+	//DBG("scales: min = %d, max = %d, w = %d", min, max, w);
+	if(!w) return NULL;
+	int l = 0;
+	while((1U << l) < w) ++l;
+	job.min = min;
+	job.s = 24 + l;
+	job.m = (uint32_t)(((1ULL << job.s) + w - 1) / w);
+	job.clr = clr;
+	run(OP_NORM);
+	return output;
+}
+
+/**
+ * Add next frame to sum
+ * @param img  - image (of size given to stack_init)
+ * @param nsum - amount of frames to sum
+ * @return normalized sum after each nsum frames (don't free it!) or NULL
+ */
+uint8_t *stack_push(uint8_t *img, int nsum){
+	uint8_t *ret;
+	if(!storage) return NULL;
+	if(nsum > STACK_MAXSUM) nsum = STACK_MAXSUM;
+	job.img = img;
+	if(++ncaptured < nsum){
+		run(OP_ADD);
+		return NULL;
+	}
+	ncaptured = 0;
+	run(OP_ADDMM);
+	if(!(ret = normalize(1))){ // flat image: nothing to normalize
+		memset(storage, 0, sizeof(uint32_t) * imW * imH);
+		return img;
+	}
+	return ret;
+}
+
+/**
+ * Add next frame to rolling sum of last nsum frames
+ * (until nsum frames captured the sum of all of them is used)
+ * @param img  - image (of size given to stack_init)
+ * @param nsum - amount of frames to sum
+ * @return normalized sum (don't free it!) or NULL
+ */
+uint8_t *stack_roll(uint8_t *img, int nsum){
+	uint8_t *ret;
+	size_t sz = (size_t)imW * (size_t)imH;
+	if(!storage) return NULL;
+	if(nsum > STACK_MAXSUM) nsum = STACK_MAXSUM;
+	if(nsum != ringsize){ // start from scratch
+		FREE(ring);
+		ring = MALLOC(uint8_t, sz * nsum);
+		memset(storage, 0, sizeof(uint32_t) * sz);
+		ringsize = nsum;
+		ringpos = 0;
+	}
+	job.img = img;
+	job.old = ring + sz * ringpos;
+	if(++ringpos == ringsize) ringpos = 0;
+	run(OP_ROLL);
+	if(!(ret = normalize(0))) return img;
+	return ret;
+}
+
+/**
+ * Free storage (threads are left waiting for the next stack_init)
+ */
+void stack_free(){
+	FREE(storage);
+	FREE(output);
+	FREE(ring);
+	ringsize = 0;
+	imW = imH = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * stack.h - summation of subsequent frames
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __STACK_H__
+#define __STACK_H__
+
+#include <stdint.h>
+
+// max amount of threads summing frame bands
+#ifndef STACK_MAXTHREADS
+	#define STACK_MAXTHREADS		4
+#endif
+
+const char *stack_isa();
+void stack_init(int w, int h, int nthreads);
+uint8_t *stack_push(uint8_t *img, int nsum);
+uint8_t *stack_roll(uint8_t *img, int nsum);
+void stack_free();
+
+#endif // __STACK_H__
@@ -0,0 +1,155 @@
+/*
+ * synthsrc.c - generator of synthetic star field
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Gaussian stars on noisy background; the whole field slowly wanders like
+ * under bad guiding. Everything depends only on frame number, so the sequence
+ * is the same on each run.
+ */
+
+#include <math.h>
+
+#include "main.h"
+#include "capsource.h"
+
+// default image size and amount of stars
+#define SYNTH_WIDTH     (1280)
+#define SYNTH_HEIGHT    (960)
+#define SYNTH_NSTARS    (30)
+#define SYNTH_MAXSTARS  (1000)
+// background level and amplitude of noise
+#define SYNTH_BG        (20)
+#define SYNTH_NOISE     (16)
+
+typedef struct{
+	double x, y;    // position
+	double flux;    // peak intensity
+	double sigma;   // PSF width
+} star;
+
+static uint8_t *image = NULL;
+static int W, H, nstars;
+static star *stars = NULL;
+static uint64_t frameno;
+
+static uint32_t rnd(uint32_t *state){ // xorshift32
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+/**
+ * Prepare generator
+ * @param arg  - "WxH[:stars]" or NULL
+ * @param w, h - image size
+ * @return 0 if failure
+ */
+static int synth_open(char *arg, int *w, int *h){
+	uint32_t seed = 12345;
+	int i;
+	W = SYNTH_WIDTH; H = SYNTH_HEIGHT; nstars = SYNTH_NSTARS;
+	if(arg && *arg){
+		char *colon = strchr(arg, ':');
+		if(sscanf(arg, "%dx%d", &W, &H) != 2 || W < 16 || H < 16 || W > 16384 || H > 16384){
+			/// "Неверный размер изображения"
+			WARNX("%s: %s", _("Wrong image size"), arg);
+			return 0;
+		}
+		if(colon) nstars = atoi(colon + 1);
+		if(nstars < 0) nstars = 0;
+		if(nstars > SYNTH_MAXSTARS) nstars = SYNTH_MAXSTARS;
+	}
+	image = MALLOC(uint8_t, (size_t)W * (size_t)H);
+	stars = MALLOC(star, nstars ? nstars : 1);
+	for(i = 0; i < nstars; ++i){
+		stars[i].x = 10. + (rnd(&seed) % (W - 20));
+		stars[i].y = 10. + (rnd(&seed) % (H - 20));
+		stars[i].flux = 20. + (rnd(&seed) % 300);
+		stars[i].sigma = 1. + (rnd(&seed) % 100) / 50.;
+	}
+	frameno = 0;
+	*w = W; *h = H;
+	DBG("synthetic %dx%d field with %d stars", W, H, nstars);
+	return 1;
+}
+
+// add star at (x, y) to image
+static void drawstar(const star *s, double x, double y){
+	int r = (int)ceil(3. * s->sigma), X, Y;
+	int x0 = (int)x, y0 = (int)y;
+	double k = -1. / (2. * s->sigma * s->sigma);
+	for(Y = y0 - r; Y <= y0 + r; ++Y){
+		if(Y < 0 || Y >= H) continue;
+		uint8_t *row = image + (size_t)Y * W;
+		double dy2 = (Y - y) * (Y - y);
+		for(X = x0 - r; X <= x0 + r; ++X){
+			if(X < 0 || X >= W) continue;
+			int v = row[X] + (int)(s->flux * exp(((X - x) * (X - x) + dy2) * k));
+			row[X] = (v > 255) ? 255 : (uint8_t)v;
+		}
+	}
+}
+
+/**
+ * Generate next frame
+ * @param w, h - image size
+ * @return image
+ */
+static uint8_t *synth_next(int *w, int *h){
+	uint32_t seed = (uint32_t)(frameno * 2654435761U) | 1;
+	size_t i, S = (size_t)W * (size_t)H;
+	int n;
+	if(!image) return NULL;
+	capsource_pace(Global_parameters->fps);
+	// background: four pixels per random number
+	for(i = 0; i + 4 <= S; i += 4){
+		uint32_t r = rnd(&seed);
+		image[i]   = SYNTH_BG + (r & (SYNTH_NOISE - 1));
+		image[i+1] = SYNTH_BG + ((r >> 8) & (SYNTH_NOISE - 1));
+		image[i+2] = SYNTH_BG + ((r >> 16) & (SYNTH_NOISE - 1));
+		image[i+3] = SYNTH_BG + ((r >> 24) & (SYNTH_NOISE - 1));
+	}
+	for(; i < S; ++i) image[i] = SYNTH_BG;
+	// slow wander plus seeing jitter
+	double t = frameno / 25.;
+	double dx = 5. * sin(t * 0.3) + (rnd(&seed) % 100) / 100. - 0.5;
+	double dy = 3. * cos(t * 0.2) + (rnd(&seed) % 100) / 100. - 0.5;
+	for(n = 0; n < nstars; ++n)
+		drawstar(&stars[n], stars[n].x + dx, stars[n].y + dy);
+	++frameno;
+	*w = W; *h = H;
+	return image;
+}
+
+static void synth_close(){
+	FREE(image);
+	FREE(stars);
+}
+
+const capsource synth_source = {
+	.name   = "synth",
+	.open   = synth_open,
+	.next   = synth_next,
+	.close  = synth_close,
+	.device = 0
+};
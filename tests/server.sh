@@ -0,0 +1,38 @@
+#
+# server.sh - common part of tests: run tvguide in background and stop it
+#
+# Set SERVER and DIR before including this file; server log is $DIR/server.log
+#
+
+# start_server <file to wait for> <server options>
+start_server(){
+	WAITFOR=$1
+	shift
+	"$SERVER" -f "$@" >"$DIR/server.log" 2>&1 &
+	SRVPID=$!
+	i=0
+	while [ ! -e "$WAITFOR" ]; do
+		i=$((i + 1))
+		if [ $i -gt 50 ] || ! kill -0 $SRVPID 2>/dev/null; then
+			echo "Server didn't start:"
+			cat "$DIR/server.log"
+			return 1
+		fi
+		sleep 0.1
+	done
+}
+
+stop_server(){
+	[ -z "$SRVPID" ] && return
+	CHILD=$(pgrep -P $SRVPID)
+	kill $SRVPID 2>/dev/null && wait $SRVPID 2>/dev/null
+	# capturing child gets SIGTERM after its parent: wait for it to free the lock
+	while [ -n "$CHILD" ] && kill -0 $CHILD 2>/dev/null; do sleep 0.1; done
+	SRVPID=""
+}
+
+cleanup(){
+	stop_server
+	[ -n "$KEEP" ] || rm -rf "$DIR"
+}
+trap cleanup EXIT
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# shmreaders.sh - several readers of shared memory frames ring at once
+#
+# Usage: shmreaders.sh [tvguide [test_client [readers [frames]]]]
+# Every reader should get frames with increasing numbers and no frame should be
+# overwritten while it is saved. Set KEEP=1 to keep logs in /tmp/shmreaders.*
+#
+
+SERVER=$(realpath "${1:-./tvguide}")
+CLIENT=$(realpath "${2:-./test_client}")
+NREADERS=${3:-4}
+NFRAMES=${4:-30}
+PORT=54398
+DIR=$(mktemp -d /tmp/shmreaders.XXXXXX)
+SOCK=$DIR/frames.sock
+
+. "$(dirname "$0")/server.sh"
+start_server "$SOCK" --source synth:640x480 -p $PORT --shm "$SOCK" || exit 1
+
+PIDS=""
+for r in $(seq $NREADERS); do
+	mkdir "$DIR/r$r"
+	(cd "$DIR/r$r" && exec "$CLIENT" -u "$SOCK" -N $NFRAMES >out.log 2>&1) &
+	PIDS="$PIDS $!"
+done
+wait $PIDS
+
+ERR=0
+for r in $(seq $NREADERS); do
+	LOG=$DIR/r$r/out.log
+	if grep -q "overwritten" "$LOG"; then
+		echo "reader $r: frame was overwritten"
+		ERR=1
+	fi
+	# frame numbers should only increase
+	if ! sed -n 's/^frame #\([0-9]*\),.*/\1/p' "$LOG" | awk -v n=$NFRAMES -v r=$r '
+		$1 <= last { printf("reader %d: frame #%d after #%d\n", r, $1, last); bad = 1 }
+		{ last = $1; ++got }
+		END {
+			if(got != n){ printf("reader %d: got %d frames of %d\n", r, got, n); bad = 1 }
+			exit bad
+		}'; then
+		ERR=1
+	fi
+done
+[ $ERR -eq 0 ] && echo "$NREADERS readers got $NFRAMES frames each"
+exit $ERR
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# vivid.sh - V4L2 mmap capture (--mmap) from virtual video device of vivid module
+#
+# Usage: vivid.sh [tvguide [test_client]]
+# Skipped (exit code 77) if there's no vivid device and module couldn't be loaded.
+#
+
+SERVER=$(realpath "${1:-./tvguide}")
+CLIENT=$(realpath "${2:-./test_client}")
+PORT=54397
+NFRAMES=5
+
+# find capture device of vivid
+vividdev(){
+	for d in /sys/class/video4linux/video*; do
+		[ -r "$d/name" ] || continue
+		case $(cat "$d/name") in
+			vivid*-vid-cap) echo "/dev/$(basename "$d")"; return 0;;
+		esac
+	done
+	return 1
+}
+
+DEV=$(vividdev)
+if [ -z "$DEV" ]; then
+	modprobe vivid >/dev/null 2>&1 && sleep 1
+	DEV=$(vividdev)
+fi
+if [ -z "$DEV" ] || [ ! -r "$DEV" ]; then
+	echo "vivid device isn't available, skipped"
+	exit 77
+fi
+
+DIR=$(mktemp -d /tmp/vivid.XXXXXX)
+SOCK=$DIR/frames.sock
+. "$(dirname "$0")/server.sh"
+start_server "$SOCK" --mmap -d "$DEV" -p $PORT --shm "$SOCK" || exit 1
+
+cd "$DIR" && "$CLIENT" -u "$SOCK" -N $NFRAMES >client.log 2>&1
+GOT=$(grep -c "^frame #" client.log)
+if [ "$GOT" -ne $NFRAMES ] || grep -q "Can't capture" server.log; then
+	echo "$DEV: got $GOT frames of $NFRAMES"
+	cat server.log client.log
+	exit 1
+fi
+echo "$DEV: $(sed -n 's/^frame #[0-9]*, \([0-9x]*\),.*/\1/p' client.log | head -1), $NFRAMES frames captured"
+exit 0
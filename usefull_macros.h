@@ -93,6 +93,7 @@ extern int (*red)(const char *fmt, ...);
 extern int (*_WARN)(const char *fmt, ...);
 extern int (*green)(const char *fmt, ...);
 void * my_alloc(size_t N, size_t S);
+double dtime();
 void initial_setup();
 
 // mmap file
@@ -0,0 +1,270 @@
+/*
+ * v4l2capt.c - direct V4L2 mmap streaming capture
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+/*
+ * Raw grabbers (GREY, YUYV & so on) don't need neither libavformat nor decoder:
+ * driver's buffers are mapped into our memory, we dequeue the filled one,
+ * give its luma plane to caller and return it to driver on the next call.
+ * For GREY and planar YUV formats without row padding there's no copying at all,
+ * other formats are converted by convert_gray.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <linux/videodev2.h>
+
+#include "main.h"
+#include "capsource.h"
+#include "capture.h"
+#include "convert.h"
+#include "v4l2capt.h"
+
+typedef struct{
+	uint8_t *start;
+	size_t length;
+} v4l2buf;
+
+static int vfd = -1;                // device file descriptor
+static v4l2buf *buffers = NULL;     // mmap'ed driver buffers
+static unsigned int nbuffers = 0;
+static int dequeued = -1;           // index of buffer given to user (or -1)
+static struct v4l2_pix_format pix;  // current format
+static convformat layout = CONV_NONE; // and its luma layout
+static uint8_t *luma = NULL;        // buffer for formats that need conversion
+
+static int xioctl(int fd, unsigned long req, void *arg){
+	int r;
+	do r = ioctl(fd, req, arg);
+	while(r == -1 && errno == EINTR);
+	return r;
+}
+
+// layout of luma in formats we can use
+static convformat getlayout(uint32_t pixfmt){
+	switch(pixfmt){
+		case V4L2_PIX_FMT_GREY:
+		case V4L2_PIX_FMT_NV12:
+		case V4L2_PIX_FMT_NV21:
+		case V4L2_PIX_FMT_YUV420:
+		case V4L2_PIX_FMT_YVU420:
+			return CONV_GREY;
+		case V4L2_PIX_FMT_Y16:
+			return CONV_Y16;
+		case V4L2_PIX_FMT_YUYV:
+			return CONV_YUYV;
+		case V4L2_PIX_FMT_UYVY:
+			return CONV_UYVY;
+		default:
+			return CONV_NONE;
+	}
+}
+
+/**
+ * Set format with luma we can use
+ * @return 0 if failure
+ */
+static int setformat(){
+	struct v4l2_format fmt;
+	const uint32_t variants[] = {V4L2_PIX_FMT_GREY, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY,
+		V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_Y16, 0};
+	int i;
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if(xioctl(vfd, VIDIOC_G_FMT, &fmt) == -1){
+		WARN("VIDIOC_G_FMT");
+		return 0;
+	}
+	for(i = 0; !getlayout(fmt.fmt.pix.pixelformat) && variants[i]; ++i){
+		fmt.fmt.pix.pixelformat = variants[i];
+		fmt.fmt.pix.field = V4L2_FIELD_ANY;
+		if(xioctl(vfd, VIDIOC_S_FMT, &fmt) == -1) // driver could change pixelformat by itself
+			DBG("VIDIOC_S_FMT failed for 0x%08X", variants[i]);
+	}
+	if(!(layout = getlayout(fmt.fmt.pix.pixelformat))){
+		/// "Устройство не поддерживает ни одного формата с яркостным каналом"
+		WARNX(_("Device doesn't support any format with luma plane"));
+		return 0;
+	}
+	pix = fmt.fmt.pix;
+	if(!pix.bytesperline) pix.bytesperline = pix.width * (layout == CONV_GREY ? 1 : 2);
+	DBG("format: %dx%d, fourcc 0x%08X, bytesperline %d, conversion: %s", pix.width, pix.height,
+		pix.pixelformat, pix.bytesperline, convert_isa());
+	return 1;
+}
+
+/**
+ * Open device and start streaming
+ * @param dev  - device file name
+ * @param w, h - image size (or NULL)
+ * @return 0 if failure
+ */
+int v4l2_prepare(char *dev, int *w, int *h){
+	struct v4l2_capability cap;
+	struct v4l2_requestbuffers req;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+	v4l2_free(); // close device after capture errors
+	if((vfd = open(dev, O_RDWR | O_NONBLOCK, 0)) < 0){
+		/// "Не могу открыть"
+		WARN("%s '%s'", _("Cannot open"), dev);
+		return 0;
+	}
+	if(xioctl(vfd, VIDIOC_QUERYCAP, &cap) == -1){
+		WARN("VIDIOC_QUERYCAP");
+		goto fail;
+	}
+	uint32_t caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps : cap.capabilities;
+	if(!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)){
+		/// "не поддерживает потоковый захват"
+		WARNX("'%s' %s", dev, _("doesn't support streaming capture"));
+		goto fail;
+	}
+	if(!setformat()) goto fail;
+	memset(&req, 0, sizeof(req));
+	req.count = V4L2_NBUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if(xioctl(vfd, VIDIOC_REQBUFS, &req) == -1 || req.count < 2){
+		/// "Не могу получить буферы видеоустройства"
+		WARN(_("Can't get video device buffers"));
+		goto fail;
+	}
+	buffers = MALLOC(v4l2buf, req.count);
+	for(nbuffers = 0; nbuffers < req.count; ++nbuffers){
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = nbuffers;
+		if(xioctl(vfd, VIDIOC_QUERYBUF, &buf) == -1){
+			WARN("VIDIOC_QUERYBUF");
+			goto fail;
+		}
+		buffers[nbuffers].length = buf.length;
+		buffers[nbuffers].start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE,
+			MAP_SHARED, vfd, buf.m.offset);
+		if(buffers[nbuffers].start == MAP_FAILED){
+			WARN("mmap");
+			goto fail;
+		}
+	}
+	for(i = 0; i < nbuffers; ++i){
+		struct v4l2_buffer buf;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if(xioctl(vfd, VIDIOC_QBUF, &buf) == -1){
+			WARN("VIDIOC_QBUF");
+			goto fail;
+		}
+	}
+	if(xioctl(vfd, VIDIOC_STREAMON, &type) == -1){
+		WARN("VIDIOC_STREAMON");
+		goto fail;
+	}
+	luma = MALLOC(uint8_t, pix.width * pix.height);
+	dequeued = -1;
+	if(w) *w = pix.width;
+	if(h) *h = pix.height;
+	return 1;
+fail:
+	v4l2_free();
+	return 0;
+}
+
+/**
+ * Get next frame from driver
+ * @param w, h - size of captured image (or NULL)
+ * @return pointer to luma plane (valid until next call) or NULL in case of error
+ */
+uint8_t *v4l2_capture(int *w, int *h){
+	struct v4l2_buffer buf;
+	struct pollfd pfd = {.fd = vfd, .events = POLLIN};
+	int i, r;
+	if(vfd < 0) return NULL;
+	if(dequeued > -1){ // return previous buffer to driver
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = dequeued;
+		if(xioctl(vfd, VIDIOC_QBUF, &buf) == -1) WARN("VIDIOC_QBUF");
+		dequeued = -1;
+	}
+	for(i = 0; i < MAX_READING_TRIES; ++i){
+		r = poll(&pfd, 1, V4L2_TIMEOUT);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) break;
+		memset(&buf, 0, sizeof(buf));
+		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if(xioctl(vfd, VIDIOC_DQBUF, &buf) == 0) break;
+		if(errno != EAGAIN){
+			r = -1;
+			break;
+		}
+	}
+	if(i == MAX_READING_TRIES || r <= 0){
+		videodev_prepared = 0;
+		/// "Не могу захватить следующий кадр"
+		WARN("%s", _("Can't capture next frame"));
+		return NULL;
+	}
+	dequeued = buf.index;
+	if(w) *w = pix.width;
+	if(h) *h = pix.height;
+	return convert_gray(layout, buffers[buf.index].start, pix.bytesperline,
+		pix.width, pix.height, luma);
+}
+
+// select input channel and open device
+static int mmap_open(char *dev, int *w, int *h){
+	if(!grab_set_chan(dev, Global_parameters->videochannel)) return 0;
+	return v4l2_prepare(dev, w, h);
+}
+
+/**
+ * Stop streaming and close device
+ */
+void v4l2_free(){
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int i;
+	if(vfd < 0) return;
+	xioctl(vfd, VIDIOC_STREAMOFF, &type);
+	for(i = 0; i < nbuffers; ++i)
+		munmap(buffers[i].start, buffers[i].length);
+	FREE(buffers);
+	nbuffers = 0;
+	FREE(luma);
+	close(vfd);
+	vfd = -1;
+	dequeued = -1;
+}
+
+// video device through V4L2 mmap streaming
+const capsource mmap_source = {
+	.name   = "mmap",
+	.open   = mmap_open,
+	.next   = v4l2_capture,
+	.close  = v4l2_free,
+	.device = 1
+};
@@ -0,0 +1,42 @@
+/*
+ * v4l2capt.h - direct V4L2 mmap streaming capture
+ *
+ * Copyright 2015 Edward V. Emelianov <eddy@sao.ru, edward.emelianoff@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ */
+
+#pragma once
+#ifndef __V4L2CAPT_H__
+#define __V4L2CAPT_H__
+
+#include <stdint.h>
+
+// amount of buffers requested from driver
+#ifndef V4L2_NBUFFERS
+	#define V4L2_NBUFFERS			4
+#endif
+
+// max time (ms) to wait for a frame from driver
+#ifndef V4L2_TIMEOUT
+	#define V4L2_TIMEOUT			2000
+#endif
+
+int v4l2_prepare(char *dev, int *w, int *h);
+uint8_t *v4l2_capture(int *w, int *h);
+void v4l2_free();
+
+#endif // __V4L2CAPT_H__